@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/**********************************************************************/
+/* Job queue shared by the callers (uthreads on any kthread) and helpers.
+ * Idle helpers sleep on a futex on 'njobs'. */
+static struct
+{
+	gt_spinlock_t lock;
+	gt_blocking_job_t *head;
+	gt_blocking_job_t **tail;
+	volatile int njobs; /* futex word */
+	volatile int nidle; /* helpers sleeping */
+	int started; /* helpers running (gt_blocking_init) */
+} gt_blocking_pool;
+
+static void *gt_blocking_helper(void *arg);
+
+/**********************************************************************/
+static void *gt_blocking_helper(void *arg)
+{
+	gt_blocking_job_t *job;
+
+	(void)arg;
+
+	/* No kthread context (main's GS base is the NULL slot till its kthread_init) */
+	kthread_clear_current();
+
+	while(1)
+	{
+		gt_spin_lock(&(gt_blocking_pool.lock));
+		while(!(job = gt_blocking_pool.head))
+		{
+			gt_blocking_pool.nidle++;
+			gt_spin_unlock(&(gt_blocking_pool.lock));
+			syscall(SYS_futex, &(gt_blocking_pool.njobs), FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+			gt_spin_lock(&(gt_blocking_pool.lock));
+			gt_blocking_pool.nidle--;
+		}
+		if(!(gt_blocking_pool.head = job->next))
+			gt_blocking_pool.tail = &(gt_blocking_pool.head);
+		gt_blocking_pool.njobs--;
+		gt_spin_unlock(&(gt_blocking_pool.lock));
+
+		errno = 0;
+		job->result = job->fn(job->arg);
+		job->error = errno;
+
+		/* The caller is switched out : it parked with the queue lock held.
+		 * The job (on its stack) is not ours after this. */
+		uthread_wakeup(job->u_obj);
+	}
+
+	return NULL;
+}
+
+/**********************************************************************/
+extern void gt_blocking_init(void)
+{
+	sigset_t all_signals, old_signals;
+	pthread_attr_t attr;
+	pthread_t helper;
+	int inx, nstarted = 0;
+
+	/* Once */
+	if(gt_blocking_pool.started)
+		return;
+
+	gt_spinlock_init(&(gt_blocking_pool.lock));
+	gt_blocking_pool.head = NULL;
+	gt_blocking_pool.tail = &(gt_blocking_pool.head);
+
+	/* Helpers must never take the scheduling signals : block them
+	 * before the helpers exist (they inherit the mask) */
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(inx = 0; inx < GT_BLOCKING_HELPERS; inx++)
+		if(!pthread_create(&helper, &attr, gt_blocking_helper, NULL))
+			nstarted++;
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+	if(!nstarted)
+		fprintf(stderr, "gt_blocking : no helper thread, calls run inline\n");
+	gt_blocking_pool.started = (nstarted > 0);
+	return;
+}
+
+/**********************************************************************/
+extern long gt_blocking_call(long (*fn)(void *), void *arg)
+{
+	kthread_context_t *k_ctx = kthread_current();
+	gt_blocking_job_t job;
+
+	if(!k_ctx || !k_ctx->krunqueue.cur_uthread || !gt_blocking_pool.started)
+		return fn(arg);
+
+	job.fn = fn;
+	job.arg = arg;
+	job.next = NULL;
+
+	k_ctx = kthread_preempt_disable_current();
+	job.u_obj = k_ctx->krunqueue.cur_uthread;
+
+	gt_spin_lock(&(gt_blocking_pool.lock));
+	*(gt_blocking_pool.tail) = &job;
+	gt_blocking_pool.tail = &(job.next);
+	gt_blocking_pool.njobs++;
+	if(gt_blocking_pool.nidle)
+		syscall(SYS_futex, &(gt_blocking_pool.njobs), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+
+	/* Queue lock is released once we are switched out */
+	uthread_park(&(gt_blocking_pool.lock));
+
+	errno = job.error;
+	return job.result;
+}
@@ -0,0 +1,36 @@
+#ifndef __GT_BLOCKING_H
+#define __GT_BLOCKING_H
+
+/**********************************************************************/
+/* Blocking calls off the kthreads.
+ * gt_blocking_call parks the calling uthread and runs fn(arg) on one of a
+ * small pool of helper OS threads (not in kthread_cpu_map, not pinned,
+ * all signals blocked), then requeues the uthread on the kthread it
+ * parked on. For calls that can not be made nonblocking : getaddrinfo,
+ * open/fsync on slow filesystems, third-party libraries.
+ * fn runs outside gtthreads : it must not call uthread api(s); gt_malloc
+ * serves it from the heap shared by threads without a kthread. From main
+ * (not a uthread) fn runs inline. */
+
+#define GT_BLOCKING_HELPERS 4
+
+typedef struct __gt_blocking_job
+{
+	long (*fn)(void *);
+	void *arg;
+	long result;
+	int error; /* errno after fn */
+	int reserved;
+	uthread_struct_t *u_obj; /* parked caller */
+	struct __gt_blocking_job *next;
+} gt_blocking_job_t;
+
+/* Starts the helpers. Called by gtthread_app_init on main before any
+ * kthread is cloned : kthreads share main's TLS, pthread_create must not
+ * run on them. */
+extern void gt_blocking_init(void);
+
+/* Returns fn's result, with errno as fn left it. */
+extern long gt_blocking_call(long (*fn)(void *), void *arg);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* gt_blocking_call on one kthread : callers park while helpers sleep in
+ * the kernel, and a ticker on the same kthread has to keep running
+ * meanwhile. Every caller gets its own result back, and errno as its
+ * call left it (a failed open : ENOENT), whatever the other uthreads
+ * did to errno in between. From main the call runs inline. */
+
+#define BLOCKING_TEST_CALLERS (2 * GT_BLOCKING_HELPERS)
+#define BLOCKING_TEST_CALL_NS (100 * 1000000UL)
+#define BLOCKING_TEST_TICK_NS 1000000UL
+#define BLOCKING_TEST_MIN_TICKS 20
+
+static volatile long callers_done;
+static volatile long ticks;
+static volatile int calls_over;
+static volatile long failures;
+
+static long blocking_sleep(void *arg)
+{
+	struct timespec ts = { 0, BLOCKING_TEST_CALL_NS };
+
+	/* Blocks the thread it runs on, not a kthread */
+	nanosleep(&ts, NULL);
+	return (long)arg * 3;
+}
+
+static long blocking_open(void *arg)
+{
+	(void)arg;
+	return open("/nonexistent/gt_blocking_test", O_RDONLY);
+}
+
+static int blocking_caller(void *arg)
+{
+	long inx = (long)arg;
+
+	if(gt_blocking_call(blocking_sleep, (void *)inx) != (inx * 3))
+		__sync_fetch_and_add(&failures, 1);
+
+	errno = 0;
+	if((gt_blocking_call(blocking_open, NULL) != -1) || (errno != ENOENT))
+		__sync_fetch_and_add(&failures, 1);
+
+	__sync_fetch_and_add(&callers_done, 1);
+	return 0;
+}
+
+static int blocking_ticker(void *arg)
+{
+	(void)arg;
+	/* errno of the callers is theirs : clobber it */
+	while(!calls_over)
+	{
+		errno = EINTR;
+		uthread_sleep_ns(BLOCKING_TEST_TICK_NS);
+		__sync_fetch_and_add(&ticks, 1);
+	}
+	return 0;
+}
+
+static int blocking_main(void *arg)
+{
+	uthread_t u_tids[BLOCKING_TEST_CALLERS], u_tid;
+	long inx;
+
+	(void)arg;
+	uthread_create(&u_tid, blocking_ticker, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	for(inx = 0; inx < BLOCKING_TEST_CALLERS; inx++)
+		uthread_create(&u_tids[inx], blocking_caller, (void *)inx, 0, UTHREAD_DEFAULT_CREDITS);
+	for(inx = 0; inx < BLOCKING_TEST_CALLERS; inx++)
+		uthread_join(u_tids[inx], NULL);
+
+	calls_over = 1;
+	uthread_join(u_tid, NULL);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	kthread_sched_t sched;
+	uthread_t u_tid;
+
+	if(argc != 2)
+	{
+		printf("Usage: blocking_test [0=PRIORITY/1=CREDIT/2=STEAL]\n");
+		exit(0);
+	}
+
+	switch(strtol(argv[1], NULL, 10))
+	{
+		case 0: sched = GT_SCHED_PRIORITY; break;
+		case 2: sched = GT_SCHED_STEAL; break;
+		default: sched = GT_SCHED_CREDIT; break;
+	}
+
+	/* One kthread : a call blocking it would stop the ticker */
+	gtthread_set_kthreads(1);
+	gtthread_app_init(sched);
+
+	errno = 0;
+	if((gt_blocking_call(blocking_open, NULL) != -1) || (errno != ENOENT))
+		__sync_fetch_and_add(&failures, 1);
+
+	uthread_create(&u_tid, blocking_main, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_detach(u_tid);
+
+	gtthread_app_exit();
+
+	if(ticks < BLOCKING_TEST_MIN_TICKS)
+		__sync_fetch_and_add(&failures, 1);
+
+	printf("callers %ld/%d, ticks %ld (min %d), failures: %ld\n", callers_done,
+			BLOCKING_TEST_CALLERS, ticks, BLOCKING_TEST_MIN_TICKS, failures);
+	return ((failures || (callers_done != BLOCKING_TEST_CALLERS)) ? 1 : 0);
+}
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+#define GT_CHAN_SLOT(chan, inx) \
+	((chan)->ring + (((chan)->head + (inx)) % (chan)->capacity) * (chan)->elem_size)
+
+static gt_chan_waiter_t *gt_chan_claim_local(gt_chan_t *chan, gt_chan_waiter_t * volatile *lone,
+		kthread_context_t *k_ctx);
+static gt_chan_waiter_t *gt_chan_first(struct gt_chan_waitq *waitq, gt_chan_waiter_t * volatile *lone);
+static int gt_chan_wait(gt_chan_t *chan, struct gt_chan_waitq *waitq, gt_chan_waiter_t * volatile *lone,
+		void *elem);
+
+/**********************************************************************/
+/* Lock-free handoff : the lone waiter, if it parked on k_ctx. We run on
+ * k_ctx with preemption disabled, so it is switched out already (it
+ * published itself with preemption disabled till then). The CAS makes it
+ * ours against the locked paths. Returns it, or NULL. */
+static gt_chan_waiter_t *gt_chan_claim_local(gt_chan_t *chan, gt_chan_waiter_t * volatile *lone,
+		kthread_context_t *k_ctx)
+{
+	gt_chan_waiter_t *waiter = *lone;
+
+	if(!waiter || (waiter->k_ctx != k_ctx) || !__sync_bool_compare_and_swap(lone, waiter, NULL))
+		return NULL;
+
+	/* Woken and parked again (same stack slot) from elsewhere meanwhile :
+	 * it drops the lock once switched out */
+	if(waiter->k_ctx != k_ctx)
+	{
+		gt_spin_lock(&(chan->lock));
+		gt_spin_unlock(&(chan->lock));
+	}
+	return waiter;
+}
+
+/* Oldest parked waiter, taken off : the lone one came before the queue.
+ * Caller holds the lock. */
+static gt_chan_waiter_t *gt_chan_first(struct gt_chan_waitq *waitq, gt_chan_waiter_t * volatile *lone)
+{
+	gt_chan_waiter_t *waiter;
+
+	while((waiter = *lone))
+		if(__sync_bool_compare_and_swap(lone, waiter, NULL))
+			return waiter;
+
+	if((waiter = TAILQ_FIRST(waitq)))
+		TAILQ_REMOVE(waitq, waiter, link);
+	return waiter;
+}
+
+/* Caller holds the lock (preemption disabled); returns with both released.
+ * lone : slot to park in when nobody else waits, or NULL.
+ * main can not park : -2, the caller retries. */
+static int gt_chan_wait(gt_chan_t *chan, struct gt_chan_waitq *waitq, gt_chan_waiter_t * volatile *lone,
+		void *elem)
+{
+	kthread_context_t *k_ctx = kthread_current();
+	gt_chan_waiter_t waiter;
+
+	if(!(waiter.u_obj = k_ctx->krunqueue.cur_uthread))
+	{
+		gt_spin_unlock(&(chan->lock));
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
+		/* The kthread that can unblock us may share our cpu */
+		sched_yield();
+		return -2;
+	}
+
+	waiter.k_ctx = k_ctx;
+	waiter.elem = elem;
+	waiter.status = -1;
+	if(lone && !*lone && TAILQ_EMPTY(waitq))
+		*lone = &waiter;
+	else
+		TAILQ_INSERT_TAIL(waitq, &waiter, link);
+	uthread_park(&(chan->lock));
+
+	/* Set by the partner (or gt_chan_close) before the wakeup */
+	return waiter.status;
+}
+
+/**********************************************************************/
+extern gt_chan_t *gt_chan_create(unsigned int elem_size, unsigned int capacity)
+{
+	gt_chan_t *chan;
+
+	if(!elem_size || !(chan = (gt_chan_t *)gt_calloc(1, sizeof(gt_chan_t))))
+		return NULL;
+
+	if(capacity && !(chan->ring = (char *)gt_malloc((unsigned long)capacity * elem_size)))
+	{
+		gt_free(chan);
+		return NULL;
+	}
+
+	gt_spinlock_init(&(chan->lock));
+	chan->elem_size = elem_size;
+	chan->capacity = capacity;
+	TAILQ_INIT(&(chan->senders));
+	TAILQ_INIT(&(chan->receivers));
+	return chan;
+}
+
+extern void gt_chan_destroy(gt_chan_t *chan)
+{
+	if(!chan)
+		return;
+
+	assert(TAILQ_EMPTY(&(chan->senders)) && TAILQ_EMPTY(&(chan->receivers)));
+	assert(!chan->lone_sender && !chan->lone_receiver);
+	gt_free(chan->ring);
+	gt_free(chan);
+	return;
+}
+
+extern int gt_chan_send(gt_chan_t *chan, const void *elem)
+{
+	kthread_context_t *k_ctx;
+	gt_chan_waiter_t *waiter;
+	int ret;
+
+	do
+	{
+		k_ctx = kthread_preempt_disable_current();
+
+		/* Same-kthread handoff : no lock */
+		if(!chan->closed && (waiter = gt_chan_claim_local(chan, &(chan->lone_receiver), k_ctx)))
+		{
+			memcpy(waiter->elem, elem, chan->elem_size);
+			waiter->status = 0;
+			uthread_wakeup(waiter->u_obj);
+			if(kthread_preempt_enable(k_ctx))
+				uthread_preempt_resched();
+			return 0;
+		}
+
+		gt_spin_lock(&(chan->lock));
+
+		if(chan->closed)
+			ret = -1;
+		else if((waiter = gt_chan_first(&(chan->receivers), &(chan->lone_receiver))))
+		{
+			/* Only possible with an empty ring : hand it over directly */
+			memcpy(waiter->elem, elem, chan->elem_size);
+			waiter->status = 0;
+			uthread_wakeup(waiter->u_obj);
+			ret = 0;
+		}
+		else if(chan->count < chan->capacity)
+		{
+			memcpy(GT_CHAN_SLOT(chan, chan->count), elem, chan->elem_size);
+			chan->count++;
+			ret = 0;
+		}
+		else if((ret = gt_chan_wait(chan, &(chan->senders),
+						chan->capacity ? NULL : &(chan->lone_sender), (void *)elem)) != -1)
+			continue; /* delivered (0) or retry from main (-2) */
+		else
+			return -1;
+
+		gt_spin_unlock(&(chan->lock));
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
+		return ret;
+	} while(ret == -2);
+
+	return ret;
+}
+
+extern int gt_chan_recv(gt_chan_t *chan, void *elem)
+{
+	kthread_context_t *k_ctx;
+	gt_chan_waiter_t *waiter;
+	int ret;
+
+	do
+	{
+		k_ctx = kthread_preempt_disable_current();
+
+		/* Same-kthread rendezvous : no lock */
+		if((waiter = gt_chan_claim_local(chan, &(chan->lone_sender), k_ctx)))
+		{
+			memcpy(elem, waiter->elem, chan->elem_size);
+			waiter->status = 0;
+			uthread_wakeup(waiter->u_obj);
+			if(kthread_preempt_enable(k_ctx))
+				uthread_preempt_resched();
+			return 0;
+		}
+
+		gt_spin_lock(&(chan->lock));
+
+		if(chan->count)
+		{
+			memcpy(elem, GT_CHAN_SLOT(chan, 0), chan->elem_size);
+			chan->head = (chan->head + 1) % chan->capacity;
+			chan->count--;
+
+			/* A parked sender takes the freed slot */
+			if((waiter = gt_chan_first(&(chan->senders), &(chan->lone_sender))))
+			{
+				memcpy(GT_CHAN_SLOT(chan, chan->count), waiter->elem, chan->elem_size);
+				chan->count++;
+				waiter->status = 0;
+				uthread_wakeup(waiter->u_obj);
+			}
+			ret = 0;
+		}
+		else if((waiter = gt_chan_first(&(chan->senders), &(chan->lone_sender))))
+		{
+			/* Rendezvous (capacity 0) : straight from the sender */
+			memcpy(elem, waiter->elem, chan->elem_size);
+			waiter->status = 0;
+			uthread_wakeup(waiter->u_obj);
+			ret = 0;
+		}
+		else if(chan->closed)
+			ret = -1;
+		else if((ret = gt_chan_wait(chan, &(chan->receivers), &(chan->lone_receiver), elem)) != -1)
+			continue;
+		else
+			return -1;
+
+		gt_spin_unlock(&(chan->lock));
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
+		return ret;
+	} while(ret == -2);
+
+	return ret;
+}
+
+extern void gt_chan_close(gt_chan_t *chan)
+{
+	kthread_context_t *k_ctx;
+	gt_chan_waiter_t *waiter;
+
+	k_ctx = kthread_preempt_disable_current();
+	gt_spin_lock(&(chan->lock));
+
+	chan->closed = 1;
+	while((waiter = gt_chan_first(&(chan->senders), &(chan->lone_sender))))
+		uthread_wakeup(waiter->u_obj); /* status stays -1 */
+	/* Parked receivers : the ring is empty */
+	while((waiter = gt_chan_first(&(chan->receivers), &(chan->lone_receiver))))
+		uthread_wakeup(waiter->u_obj);
+
+	gt_spin_unlock(&(chan->lock));
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+	return;
+}
@@ -0,0 +1,93 @@
+#ifndef __GT_CHAN_H
+#define __GT_CHAN_H
+
+/**********************************************************************/
+/* Bounded multi-producer/multi-consumer channels between uthreads.
+ * Elements are fixed-size (elem_size bytes, copied in and out). A sender
+ * on a full channel or a receiver on an empty one parks on the channel and
+ * is woken through the runqueue of the kthread it parked on.
+ * A sender that finds a parked receiver (or a receiver that finds a parked
+ * sender) copies the element straight into/out of the waiter's own buffer :
+ * no trip through the ring. capacity 0 is a rendezvous channel.
+ * A waiter parked alone is also published in a lone slot : a partner on
+ * the kthread it parked on hands over without the channel lock.
+ * From main (not a uthread) send/recv spin instead of parking, till a
+ * uthread on another kthread makes room or sends. main's own kthread
+ * runs uthreads only from gtthread_app_exit : main must not block on a
+ * channel with a single kthread (it would spin for ever). */
+
+typedef struct __gt_chan_waiter
+{
+	uthread_struct_t *u_obj;
+	kthread_context_t *k_ctx; /* kthread it parked on */
+	void *elem; /* element to send / buffer to receive into */
+	int status; /* 0, or -1 : channel closed */
+	int reserved;
+	TAILQ_ENTRY(__gt_chan_waiter) link;
+} gt_chan_waiter_t;
+
+TAILQ_HEAD(gt_chan_waitq, __gt_chan_waiter);
+
+typedef struct __gt_chan
+{
+	gt_spinlock_t lock; /* taken with preemption disabled */
+	unsigned int elem_size;
+	unsigned int capacity;
+	unsigned int head; /* ring : oldest element */
+	unsigned int count;
+	int closed;
+	int reserved;
+	char *ring; /* capacity * elem_size */
+
+	struct gt_chan_waitq senders; /* parked, FIFO */
+	struct gt_chan_waitq receivers;
+
+	/* Parked with empty queues (ahead of them), taken by CAS. Receivers;
+	 * senders on capacity 0 only (else the ring is full behind them). */
+	gt_chan_waiter_t * volatile lone_receiver;
+	gt_chan_waiter_t * volatile lone_sender;
+} gt_chan_t;
+
+extern gt_chan_t *gt_chan_create(unsigned int elem_size, unsigned int capacity);
+/* No uthread may be using the channel any more */
+extern void gt_chan_destroy(gt_chan_t *chan);
+
+/* 0, or -1 if the channel is closed (for recv : closed and drained) */
+extern int gt_chan_send(gt_chan_t *chan, const void *elem);
+extern int gt_chan_recv(gt_chan_t *chan, void *elem);
+
+/* Parked and later senders fail; receivers drain what is left, then fail. */
+extern void gt_chan_close(gt_chan_t *chan);
+
+/**********************************************************************/
+/* Typed channels : GT_CHAN_DECLARE(int, int) declares gt_chan_int_t and
+ * gt_chan_int_create/destroy/send/recv/close, elements passed by value
+ * (send) or by pointer (recv). */
+#define GT_CHAN_DECLARE(name, type) \
+	typedef struct __gt_chan_##name \
+	{ \
+		gt_chan_t *chan; \
+	} gt_chan_##name##_t; \
+	\
+	static inline int gt_chan_##name##_create(gt_chan_##name##_t *tchan, unsigned int capacity) \
+	{ \
+		return (tchan->chan = gt_chan_create(sizeof(type), capacity)) ? 0 : -1; \
+	} \
+	static inline void gt_chan_##name##_destroy(gt_chan_##name##_t *tchan) \
+	{ \
+		gt_chan_destroy(tchan->chan); \
+	} \
+	static inline int gt_chan_##name##_send(gt_chan_##name##_t *tchan, type elem) \
+	{ \
+		return gt_chan_send(tchan->chan, &elem); \
+	} \
+	static inline int gt_chan_##name##_recv(gt_chan_##name##_t *tchan, type *elem) \
+	{ \
+		return gt_chan_recv(tchan->chan, elem); \
+	} \
+	static inline void gt_chan_##name##_close(gt_chan_##name##_t *tchan) \
+	{ \
+		gt_chan_close(tchan->chan); \
+	}
+
+#endif
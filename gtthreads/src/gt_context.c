@@ -0,0 +1,123 @@
+#include "gt_context.h"
+
+/* Offsets below must match gt_context_t (gt_context.h). */
+
+/* First frame of a context built by gt_context_make :
+ * func in %r12, arg in %r13. func does not return. */
+extern void gt_context_trampoline(void);
+
+/**********************************************************************/
+/* int gt_context_save(gt_context_t *ctx) : ctx in %rdi */
+__asm__ (
+	".text\n"
+	".globl gt_context_save\n"
+	".type gt_context_save, @function\n"
+	"gt_context_save:\n\t"
+	"movq %rbx, 0x00(%rdi)\n\t"
+	"movq %rbp, 0x08(%rdi)\n\t"
+	"movq %r12, 0x10(%rdi)\n\t"
+	"movq %r13, 0x18(%rdi)\n\t"
+	"movq %r14, 0x20(%rdi)\n\t"
+	"movq %r15, 0x28(%rdi)\n\t"
+	"leaq 8(%rsp), %rdx\n\t"	/* caller's sp (after our return) */
+	"movq %rdx, 0x30(%rdi)\n\t"
+	"movq (%rsp), %rdx\n\t"		/* return address */
+	"movq %rdx, 0x38(%rdi)\n\t"
+	"stmxcsr 0x40(%rdi)\n\t"
+	"fnstcw 0x44(%rdi)\n\t"
+	"xorl %eax, %eax\n\t"
+	"ret\n"
+	".size gt_context_save, .-gt_context_save\n"
+);
+
+/**********************************************************************/
+/* void gt_context_restore(gt_context_t *ctx) : ctx in %rdi */
+__asm__ (
+	".text\n"
+	".globl gt_context_restore\n"
+	".type gt_context_restore, @function\n"
+	"gt_context_restore:\n\t"
+	"movq 0x00(%rdi), %rbx\n\t"
+	"movq 0x08(%rdi), %rbp\n\t"
+	"movq 0x10(%rdi), %r12\n\t"
+	"movq 0x18(%rdi), %r13\n\t"
+	"movq 0x20(%rdi), %r14\n\t"
+	"movq 0x28(%rdi), %r15\n\t"
+	"ldmxcsr 0x40(%rdi)\n\t"
+	"fldcw 0x44(%rdi)\n\t"
+	"movq 0x30(%rdi), %rsp\n\t"
+	"movl $1, %eax\n\t"		/* gt_context_save returns 1 */
+	"jmpq *0x38(%rdi)\n"
+	".size gt_context_restore, .-gt_context_restore\n"
+);
+
+/**********************************************************************/
+/* void gt_context_switch(gt_context_t *from, gt_context_t *to) :
+ * from in %rdi, to in %rsi */
+__asm__ (
+	".text\n"
+	".globl gt_context_switch\n"
+	".type gt_context_switch, @function\n"
+	"gt_context_switch:\n\t"
+	"movq %rbx, 0x00(%rdi)\n\t"
+	"movq %rbp, 0x08(%rdi)\n\t"
+	"movq %r12, 0x10(%rdi)\n\t"
+	"movq %r13, 0x18(%rdi)\n\t"
+	"movq %r14, 0x20(%rdi)\n\t"
+	"movq %r15, 0x28(%rdi)\n\t"
+	"leaq 8(%rsp), %rdx\n\t"
+	"movq %rdx, 0x30(%rdi)\n\t"
+	"movq (%rsp), %rdx\n\t"
+	"movq %rdx, 0x38(%rdi)\n\t"
+	"stmxcsr 0x40(%rdi)\n\t"
+	"fnstcw 0x44(%rdi)\n\t"
+	"movq 0x00(%rsi), %rbx\n\t"
+	"movq 0x08(%rsi), %rbp\n\t"
+	"movq 0x10(%rsi), %r12\n\t"
+	"movq 0x18(%rsi), %r13\n\t"
+	"movq 0x20(%rsi), %r14\n\t"
+	"movq 0x28(%rsi), %r15\n\t"
+	"ldmxcsr 0x40(%rsi)\n\t"
+	"fldcw 0x44(%rsi)\n\t"
+	"movq 0x30(%rsi), %rsp\n\t"
+	"movl $1, %eax\n\t"
+	"jmpq *0x38(%rsi)\n"
+	".size gt_context_switch, .-gt_context_switch\n"
+);
+
+/**********************************************************************/
+/* void gt_context_trampoline(void) */
+__asm__ (
+	".text\n"
+	".globl gt_context_trampoline\n"
+	".type gt_context_trampoline, @function\n"
+	"gt_context_trampoline:\n\t"
+	"movq %r13, %rdi\n\t"
+	"callq *%r12\n\t"
+	"ud2\n"
+	".size gt_context_trampoline, .-gt_context_trampoline\n"
+);
+
+/**********************************************************************/
+extern void gt_context_make(gt_context_t *ctx, void *stack, unsigned long size,
+				void (*func)(void *), void *arg)
+{
+	unsigned long sp;
+
+	/* SysV ABI : (sp + 8) is 16-byte aligned at function entry.
+	 * The trampoline's call pushes the 8 bytes. */
+	sp = ((unsigned long)stack + size) & ~0x0FUL;
+
+	ctx->rbx = 0;
+	ctx->rbp = 0; /* terminates frame-pointer backtraces */
+	ctx->r12 = (unsigned long)func;
+	ctx->r13 = (unsigned long)arg;
+	ctx->r14 = 0;
+	ctx->r15 = 0;
+	ctx->rsp = sp;
+	ctx->rip = (unsigned long)gt_context_trampoline;
+	ctx->mxcsr = 0x1F80; /* all exceptions masked, round to nearest */
+	ctx->fpucw = 0x037F; /* x87 default (extended precision) */
+
+	return;
+}
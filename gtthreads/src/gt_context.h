@@ -0,0 +1,42 @@
+#ifndef __GT_CONTEXT_H
+#define __GT_CONTEXT_H
+
+/**********************************************************************/
+/* x86-64 uthread/kthread execution context.
+ * Only what the SysV ABI requires a callee to preserve is kept :
+ * callee-saved registers, stack pointer, resume address and the
+ * x87/SSE control words. The signal mask is NOT saved (unlike sigjmp_buf),
+ * so a switch never enters the kernel. */
+
+typedef struct __gt_context
+{
+	unsigned long rbx;	/* 0x00 */
+	unsigned long rbp;	/* 0x08 */
+	unsigned long r12;	/* 0x10 */
+	unsigned long r13;	/* 0x18 */
+	unsigned long r14;	/* 0x20 */
+	unsigned long r15;	/* 0x28 */
+	unsigned long rsp;	/* 0x30 */
+	unsigned long rip;	/* 0x38 */
+	unsigned int mxcsr;	/* 0x40 */
+	unsigned short fpucw;	/* 0x44 */
+	unsigned short reserved;
+} gt_context_t;
+
+/* Saves the current context. Returns 0 when saving and 1 when
+ * resumed through gt_context_restore/gt_context_switch (like setjmp). */
+extern int gt_context_save(gt_context_t *ctx) __attribute__((returns_twice));
+
+/* Resumes a saved context. Does not return. */
+extern void gt_context_restore(gt_context_t *ctx) __attribute__((noreturn));
+
+/* Saves the current context in 'from' and resumes 'to'.
+ * Returns when 'from' is resumed. */
+extern void gt_context_switch(gt_context_t *from, gt_context_t *to);
+
+/* Builds a fresh context on [stack, stack + size). Resuming it calls
+ * func(arg) on that stack. func must never return. */
+extern void gt_context_make(gt_context_t *ctx, void *stack, unsigned long size,
+				void (*func)(void *), void *arg);
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* GT_SCHED_CREDIT on one kthread : a spinner capped at 25% of it, alone,
+ * has to get about that share even though the kthread is otherwise
+ * idle; then two spinners weighted 1:3 have to split it about 1:3.
+ * Shares are measured by the spinners themselves, from the gaps in
+ * their own clock readings, not from the scheduler's accounting. */
+
+#define CREDIT_TEST_TIMESLICE_USEC 10000
+#define CREDIT_TEST_WINDOW_NS (1000 * 1000000UL)
+#define CREDIT_TEST_GAP_NS 200000UL /* longer : switched out */
+
+#define CREDIT_TEST_CAP 25
+#define CREDIT_TEST_LIGHT UTHREAD_DEFAULT_CREDITS
+#define CREDIT_TEST_HEAVY (3 * UTHREAD_DEFAULT_CREDITS)
+#define CREDIT_TEST_TOLERANCE 10 /* percentage points */
+
+typedef struct credit_spin
+{
+	unsigned long start; /* common to the spinners of a phase */
+	unsigned long ran;
+} credit_spin_t;
+
+static volatile unsigned long capped_pct, heavy_pct;
+static volatile long failures;
+
+static int credit_spinner(void *arg)
+{
+	credit_spin_t *spin = (credit_spin_t *)arg;
+	unsigned long end = spin->start + CREDIT_TEST_WINDOW_NS, prev, now;
+
+	for(prev = gt_timer_now(); prev < end; prev = now)
+	{
+		now = gt_timer_now();
+		if((now - prev) < CREDIT_TEST_GAP_NS)
+			spin->ran += now - prev;
+	}
+	return 0;
+}
+
+static int credit_main(void *arg)
+{
+	credit_spin_t capped, light, heavy;
+	uthread_t u_tid, u_light, u_heavy;
+
+	(void)arg;
+	memset(&capped, 0, sizeof(capped));
+	capped.start = gt_timer_now();
+	uthread_create(&u_tid, credit_spinner, &capped, 0, UTHREAD_DEFAULT_CREDITS);
+	if(uthread_set_credits(u_tid, UTHREAD_DEFAULT_CREDITS, CREDIT_TEST_CAP))
+		__sync_fetch_and_add(&failures, 1);
+	uthread_join(u_tid, NULL);
+	capped_pct = capped.ran * 100 / CREDIT_TEST_WINDOW_NS;
+
+	memset(&light, 0, sizeof(light));
+	memset(&heavy, 0, sizeof(heavy));
+	light.start = heavy.start = gt_timer_now();
+	uthread_create(&u_light, credit_spinner, &light, 0, CREDIT_TEST_LIGHT);
+	uthread_create(&u_heavy, credit_spinner, &heavy, 0, CREDIT_TEST_HEAVY);
+	uthread_join(u_light, NULL);
+	uthread_join(u_heavy, NULL);
+	if(light.ran + heavy.ran)
+		heavy_pct = heavy.ran * 100 / (light.ran + heavy.ran);
+	return 0;
+}
+
+static unsigned long credit_off(unsigned long pct, unsigned long want)
+{
+	return ((pct > want) ? (pct - want) : (want - pct));
+}
+
+int main()
+{
+	uthread_t u_tid;
+
+	gtthread_set_kthreads(1);
+	gtthread_set_timeslice(CREDIT_TEST_TIMESLICE_USEC);
+	gtthread_app_init(GT_SCHED_CREDIT);
+
+	uthread_create(&u_tid, credit_main, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_detach(u_tid);
+
+	gtthread_app_exit();
+
+	if(credit_off(capped_pct, CREDIT_TEST_CAP) > CREDIT_TEST_TOLERANCE)
+		__sync_fetch_and_add(&failures, 1);
+	if(credit_off(heavy_pct, (CREDIT_TEST_HEAVY * 100) / (CREDIT_TEST_LIGHT + CREDIT_TEST_HEAVY)) > CREDIT_TEST_TOLERANCE)
+		__sync_fetch_and_add(&failures, 1);
+
+	printf("capped share %lu%% (cap %d%%), heavy share %lu%% (weights %d:%d), failures: %ld\n", capped_pct,
+			CREDIT_TEST_CAP, heavy_pct, CREDIT_TEST_LIGHT, CREDIT_TEST_HEAVY, failures);
+	return (failures ? 1 : 0);
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* x86-64 : stores are not reordered with stores, nor loads with loads.
+ * Only the compiler has to be kept in order. */
+#define GT_DEQUE_BARRIER() __asm__ __volatile__ ("" : : : "memory")
+
+static gt_deque_ring_t *gt_deque_grow(gt_deque_t *deque, long top, long bottom);
+
+/**********************************************************************/
+/* Copies the live items [top, bottom) into a ring twice the size */
+static gt_deque_ring_t *gt_deque_grow(gt_deque_t *deque, long top, long bottom)
+{
+	gt_deque_ring_t *old = deque->ring, *ring;
+	unsigned long size;
+	long inx;
+
+	size = old ? ((old->mask + 1) << 1) : GT_DEQUE_INIT_SIZE;
+	if(!(ring = (gt_deque_ring_t *)gt_malloc(sizeof(gt_deque_ring_t) + size * sizeof(void *))))
+		return NULL;
+
+	ring->mask = size - 1;
+	ring->retired = old;
+	for(inx = top; inx < bottom; inx++)
+		ring->slots[inx & ring->mask] = old->slots[inx & old->mask];
+
+	GT_DEQUE_BARRIER();
+	deque->ring = ring;
+	return ring;
+}
+
+/**********************************************************************/
+extern void gt_deque_init(gt_deque_t *deque)
+{
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->ring = NULL;
+	return;
+}
+
+extern int gt_deque_push(gt_deque_t *deque, void *item)
+{
+	gt_deque_ring_t *ring = deque->ring;
+	long bottom = deque->bottom, top = deque->top;
+
+	if(!ring || (unsigned long)(bottom - top) > ring->mask)
+	{
+		if(!(ring = gt_deque_grow(deque, top, bottom)))
+			return -1;
+	}
+
+	/* Item (and a new ring) visible before the new bottom */
+	ring->slots[bottom & ring->mask] = item;
+	GT_DEQUE_BARRIER();
+	deque->bottom = bottom + 1;
+	return 0;
+}
+
+extern void *gt_deque_steal(gt_deque_t *deque)
+{
+	void *item;
+
+	return gt_deque_steal_half(deque, &item, 1) ? item : NULL;
+}
+
+extern int gt_deque_steal_half(gt_deque_t *deque, void **items, int max)
+{
+	gt_deque_ring_t *ring;
+	long top, bottom, nitems, inx;
+
+	for(;;)
+	{
+		top = deque->top;
+		GT_DEQUE_BARRIER();
+		bottom = deque->bottom;
+		if(top >= bottom)
+			return 0;
+
+		nitems = (bottom - top + 1) >> 1;
+		if(nitems > max)
+			nitems = max;
+
+		/* The slots may be reused once top moves past them : read them
+		 * first. If the owner wrapped onto them, top has moved and the
+		 * CAS fails. */
+		GT_DEQUE_BARRIER();
+		ring = deque->ring;
+		for(inx = 0; inx < nitems; inx++)
+			items[inx] = ring->slots[(top + inx) & ring->mask];
+
+		if(__sync_bool_compare_and_swap(&(deque->top), top, top + nitems))
+			return (int)nitems;
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef __GT_DEQUE_H
+#define __GT_DEQUE_H
+
+/**********************************************************************/
+/* Lock-free work-stealing deque (Chase-Lev), one per kthread (GT_SCHED_STEAL).
+ * Only the owner kthread pushes, at the bottom. Everybody, the owner
+ * included, takes from the top with a CAS. The owner does not pop the
+ * bottom : taking from the top keeps timesliced uthreads round-robin.
+ * The ring grows (doubles) when full. Outgrown rings are kept on a chain
+ * for the life of the kthread (a thief may still be reading one) : at
+ * most the size of the current ring again.
+ * Owner calls are made with preemption disabled. */
+
+#define GT_DEQUE_INIT_SIZE 256 /* power of 2 */
+#define GT_DEQUE_STEAL_MAX 64 /* most items taken by one gt_deque_steal_half */
+
+typedef struct __gt_deque_ring
+{
+	unsigned long mask; /* size - 1 */
+	struct __gt_deque_ring *retired; /* smaller ring it replaced */
+	void *slots[];
+} gt_deque_ring_t;
+
+typedef struct __gt_deque
+{
+	volatile long top; /* next to take (CAS) */
+	volatile long bottom __attribute__((aligned(64))); /* next free (owner) */
+	gt_deque_ring_t * volatile ring; /* allocated on first push */
+} gt_deque_t;
+
+extern void gt_deque_init(gt_deque_t *deque);
+
+/* Owner only. -1 if the ring could not grow. */
+extern int gt_deque_push(gt_deque_t *deque, void *item);
+
+/* Oldest item, or NULL if empty */
+extern void *gt_deque_steal(gt_deque_t *deque);
+/* Takes about half of the items (at most 'max') in one CAS, oldest first.
+ * Returns the number stored in items[]. */
+extern int gt_deque_steal_half(gt_deque_t *deque, void **items, int max);
+
+/* Snapshot; may be stale by the time it is used */
+static inline long gt_deque_size(gt_deque_t *deque)
+{
+	long size = deque->bottom - deque->top;
+
+	return (size > 0) ? size : 0;
+}
+
+#endif
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* Loopback echo benchmark : one listener uthread, one server uthread per
+ * connection and 'nconns' client uthreads, each doing 'nmsgs' round trips
+ * of 'msg_size' bytes. All in this process, on gtthreads kthreads (no
+ * extra OS threads); the sockets go through the gt_io reactor. */
+
+static int nconns = 256;
+static int nmsgs = 1000;
+static int msg_size = 64;
+
+static struct sockaddr_in server_addr;
+static int listen_fd;
+
+static volatile long round_trips;
+static volatile long failures;
+
+/* Reads exactly 'count' bytes (0 at EOF) */
+static ssize_t read_full(int fd, char *buf, size_t count)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while(done < count)
+	{
+		if((ret = uthread_read(fd, buf + done, count - done)) <= 0)
+			return ret;
+		done += ret;
+	}
+	return done;
+}
+
+static ssize_t write_full(int fd, const char *buf, size_t count)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while(done < count)
+	{
+		if((ret = uthread_write(fd, buf + done, count - done)) < 0)
+			return ret;
+		done += ret;
+	}
+	return done;
+}
+
+static int echo_server(void *arg)
+{
+	int fd = (int)(long)arg;
+	char *buf = (char *)gt_malloc(msg_size);
+	ssize_t ret;
+
+	while((ret = uthread_read(fd, buf, msg_size)) > 0)
+	{
+		if(write_full(fd, buf, ret) < 0)
+			break;
+	}
+
+	gt_free(buf);
+	uthread_close(fd);
+	return 0;
+}
+
+static int echo_listener(void *arg)
+{
+	uthread_t u_tid;
+	int inx, fd;
+
+	(void)arg;
+
+	for(inx = 0; inx < nconns; inx++)
+	{
+		if((fd = uthread_accept(listen_fd, NULL, NULL)) < 0)
+		{
+			perror("accept");
+			__sync_fetch_and_add(&failures, 1);
+			continue;
+		}
+
+		uthread_create(&u_tid, echo_server, (void *)(long)fd, 0, UTHREAD_DEFAULT_CREDITS);
+		uthread_detach(u_tid);
+	}
+
+	uthread_close(listen_fd);
+	return 0;
+}
+
+static int echo_client(void *arg)
+{
+	char *out = (char *)gt_malloc(msg_size);
+	char *in = (char *)gt_malloc(msg_size);
+	int inx, fd, one = 1;
+
+	if((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		goto fail;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if(uthread_connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+	{
+		uthread_close(fd);
+		goto fail;
+	}
+
+	memset(out, (int)(long)arg, msg_size);
+	for(inx = 0; inx < nmsgs; inx++)
+	{
+		out[0] = (char)inx;
+		if((write_full(fd, out, msg_size) < 0) || (read_full(fd, in, msg_size) <= 0) ||
+			memcmp(in, out, msg_size))
+		{
+			uthread_close(fd);
+			goto fail;
+		}
+		__sync_fetch_and_add(&round_trips, 1);
+	}
+
+	uthread_close(fd);
+	gt_free(in);
+	gt_free(out);
+	return 0;
+
+fail:
+	__sync_fetch_and_add(&failures, 1);
+	gt_free(in);
+	gt_free(out);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	kthread_sched_t sched;
+	struct timeval start, end, elapsed;
+	socklen_t addrlen = sizeof(server_addr);
+	uthread_t u_tid;
+	double secs;
+	int inx, one = 1;
+
+	if((argc < 2) || (argc > 5))
+	{
+		printf("Usage: echo_bench [0=PRIORITY/1=CREDIT/2=STEAL] [conns] [msgs] [size]\n");
+		exit(0);
+	}
+
+	switch(strtol(argv[1], NULL, 10))
+	{
+		case 0: sched = GT_SCHED_PRIORITY; break;
+		case 2: sched = GT_SCHED_STEAL; break;
+		default: sched = GT_SCHED_CREDIT; break;
+	}
+	if(argc > 2)
+		nconns = strtol(argv[2], NULL, 10);
+	if(argc > 3)
+		nmsgs = strtol(argv[3], NULL, 10);
+	if(argc > 4)
+		msg_size = strtol(argv[4], NULL, 10);
+
+	/* Loopback listener on an ephemeral port */
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) ||
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+		bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) ||
+		listen(listen_fd, 4096) ||
+		getsockname(listen_fd, (struct sockaddr *)&server_addr, &addrlen))
+	{
+		perror("listen");
+		exit(1);
+	}
+
+	printf("Scheduler: %s, %d connections x %d messages of %d bytes\n",
+			(sched == GT_SCHED_PRIORITY) ? "PRIORITY" : ((sched == GT_SCHED_STEAL) ? "STEAL" : "CREDIT"), nconns, nmsgs, msg_size);
+
+	gtthread_app_init(sched);
+
+	gettimeofday(&start, NULL);
+
+	uthread_create(&u_tid, echo_listener, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_detach(u_tid);
+	for(inx = 0; inx < nconns; inx++)
+	{
+		uthread_create(&u_tid, echo_client, (void *)(long)inx, 0, UTHREAD_DEFAULT_CREDITS);
+		uthread_detach(u_tid);
+	}
+
+	gtthread_app_exit();
+
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &elapsed);
+	secs = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+
+	printf("round trips: %ld, failures: %ld, time: %.3f s, %.0f round trips/s, mean rtt: %.1f us\n",
+			round_trips, failures, secs, round_trips / secs,
+			round_trips ? (secs * 1000000.0 * nconns) / round_trips : 0.0);
+	return (failures ? 1 : 0);
+}
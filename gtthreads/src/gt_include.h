@@ -5,9 +5,19 @@
 #include "gt_spinlock.h"
 #include "gt_tailq.h"
 #include "gt_bitops.h"
+#include "gt_context.h"
+#include "gt_stack.h"
+#include "gt_malloc.h"
+#include "gt_timer.h"
+#include "gt_deque.h"
 
 #include "gt_uthread.h"
 #include "gt_pq.h"
+#include "gt_uring.h"
 #include "gt_kthread.h"
+#include "gt_mutex.h"
+#include "gt_io.h"
+#include "gt_blocking.h"
+#include "gt_chan.h"
 
 #endif
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/**********************************************************************/
+/* fd table : pages are allocated on first use and never freed */
+static gt_io_fd_t * volatile gt_io_fds[GT_IO_FD_PAGES];
+
+static gt_io_fd_t *gt_io_fd(int fd);
+static int gt_io_register(gt_io_fd_t *fdp, int fd);
+static int gt_io_wait(gt_io_fd_t *fdp, int fd, int event);
+
+/**********************************************************************/
+static gt_io_fd_t *gt_io_fd(int fd)
+{
+	unsigned int page = (unsigned int)fd >> GT_IO_FD_PAGE_SHIFT;
+	gt_io_fd_t *fd_page;
+
+	if((fd < 0) || (page >= GT_IO_FD_PAGES))
+		return NULL;
+
+	if(!(fd_page = gt_io_fds[page]))
+	{
+		if(!(fd_page = (gt_io_fd_t *)gt_calloc(1UL << GT_IO_FD_PAGE_SHIFT, sizeof(gt_io_fd_t))))
+			return NULL;
+
+		/* Lost the race : use the winner's page */
+		if(!__sync_bool_compare_and_swap(&(gt_io_fds[page]), NULL, fd_page))
+		{
+			gt_free(fd_page);
+			fd_page = gt_io_fds[page];
+		}
+	}
+
+	return &fd_page[fd & ((1 << GT_IO_FD_PAGE_SHIFT) - 1)];
+}
+
+/* Makes the fd nonblocking and adds it to the caller kthread's epoll set.
+ * Edge-triggered : registered once, no re-arming per wait. */
+static int gt_io_register(gt_io_fd_t *fdp, int fd)
+{
+	kthread_context_t *k_ctx;
+	struct epoll_event ev;
+	int flags, ret = 0;
+
+	k_ctx = kthread_preempt_disable_current();
+	gt_spin_lock(&(fdp->lock));
+
+	if(!(fdp->flags & GT_IO_REGISTERED))
+	{
+		if(((flags = fcntl(fd, F_GETFL)) < 0) ||
+			(!(flags & O_NONBLOCK) && (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)))
+			ret = -1;
+		else
+		{
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.ptr = fdp;
+			if(epoll_ctl(k_ctx->kthread_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+				ret = -1;
+			else
+			{
+				/* Current readiness is reported as a first edge */
+				fdp->flags = GT_IO_REGISTERED;
+				fdp->ready = 0;
+				fdp->k_ctx = k_ctx;
+			}
+		}
+	}
+
+	gt_spin_unlock(&(fdp->lock));
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+
+	return ret;
+}
+
+/* Returns once the fd may be ready for 'event' (the caller retries the
+ * call, and comes back on EAGAIN). */
+static int gt_io_wait(gt_io_fd_t *fdp, int fd, int event)
+{
+	kthread_context_t *k_ctx;
+	uthread_struct_t *u_self;
+	struct pollfd pfd;
+
+	k_ctx = kthread_preempt_disable_current();
+
+	if(!(u_self = k_ctx->krunqueue.cur_uthread))
+	{
+		/* main : block the kthread */
+		kthread_preempt_enable(k_ctx);
+		pfd.fd = fd;
+		pfd.events = (event == GT_IO_READ) ? POLLIN : POLLOUT;
+		return (poll(&pfd, 1, -1) < 0) ? -1 : 0;
+	}
+
+	gt_spin_lock(&(fdp->lock));
+
+	/* An edge came in before we got here */
+	if(fdp->ready & event)
+	{
+		fdp->ready &= ~event;
+		gt_spin_unlock(&(fdp->lock));
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
+		return 0;
+	}
+
+	if(event == GT_IO_READ)
+	{
+		assert(!fdp->reader);
+		fdp->reader = u_self;
+	}
+	else
+	{
+		assert(!fdp->writer);
+		fdp->writer = u_self;
+	}
+
+	/* The reactor may be another kthread, asleep without its epoll set */
+	__sync_fetch_and_add(&(fdp->k_ctx->kthread_io_waiters), 1);
+	if(fdp->k_ctx != k_ctx)
+		kthread_kick(fdp->k_ctx);
+	uthread_park(&(fdp->lock));
+	return 0;
+}
+
+/**********************************************************************/
+extern int gt_io_init(kthread_context_t *k_ctx)
+{
+	if((k_ctx->kthread_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return -1;
+
+	k_ctx->kthread_io_waiters = 0;
+	return 0;
+}
+
+extern int gt_io_poll(kthread_context_t *k_ctx, gt_spinlock_t *held)
+{
+	struct epoll_event events[GT_IO_EVENTS];
+	uthread_struct_t *u_obj;
+	gt_io_fd_t *fdp;
+	int inx, nevents, ready, nwoken = 0;
+
+	/* Nobody parked on our fds : no syscall */
+	if(!k_ctx->kthread_io_waiters)
+		return 0;
+
+	if((nevents = epoll_wait(k_ctx->kthread_epfd, events, GT_IO_EVENTS, 0)) <= 0)
+		return 0;
+
+	for(inx = 0; inx < nevents; inx++)
+	{
+		fdp = (gt_io_fd_t *)events[inx].data.ptr;
+
+		ready = 0;
+		if(events[inx].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			ready |= GT_IO_READ;
+		if(events[inx].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			ready |= GT_IO_WRITE;
+
+		if(&(fdp->lock) != held)
+			gt_spin_lock(&(fdp->lock));
+
+		if((ready & GT_IO_READ) && (u_obj = fdp->reader))
+		{
+			fdp->reader = NULL;
+			ready &= ~GT_IO_READ;
+			uthread_wakeup(u_obj);
+			nwoken++;
+		}
+
+		if((ready & GT_IO_WRITE) && (u_obj = fdp->writer))
+		{
+			fdp->writer = NULL;
+			ready &= ~GT_IO_WRITE;
+			uthread_wakeup(u_obj);
+			nwoken++;
+		}
+
+		/* Kept for the next waiter */
+		fdp->ready |= ready;
+		if(&(fdp->lock) != held)
+			gt_spin_unlock(&(fdp->lock));
+	}
+
+	__sync_fetch_and_sub(&(k_ctx->kthread_io_waiters), nwoken);
+	return nwoken;
+}
+
+/**********************************************************************/
+extern ssize_t uthread_read(int fd, void *buf, size_t count)
+{
+	gt_io_fd_t *fdp;
+	ssize_t ret;
+
+	if(!(fdp = gt_io_fd(fd)))
+		return read(fd, buf, count);
+
+	if(!(fdp->flags & GT_IO_REGISTERED) && gt_io_register(fdp, fd))
+		return -1;
+
+	while(((ret = read(fd, buf, count)) < 0) && (errno == EAGAIN))
+		if(gt_io_wait(fdp, fd, GT_IO_READ))
+			return -1;
+
+	return ret;
+}
+
+extern ssize_t uthread_write(int fd, const void *buf, size_t count)
+{
+	gt_io_fd_t *fdp;
+	ssize_t ret;
+
+	if(!(fdp = gt_io_fd(fd)))
+		return write(fd, buf, count);
+
+	if(!(fdp->flags & GT_IO_REGISTERED) && gt_io_register(fdp, fd))
+		return -1;
+
+	while(((ret = write(fd, buf, count)) < 0) && (errno == EAGAIN))
+		if(gt_io_wait(fdp, fd, GT_IO_WRITE))
+			return -1;
+
+	return ret;
+}
+
+extern int uthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	gt_io_fd_t *fdp;
+	int ret;
+
+	if(!(fdp = gt_io_fd(fd)))
+		return accept(fd, addr, addrlen);
+
+	if(!(fdp->flags & GT_IO_REGISTERED) && gt_io_register(fdp, fd))
+		return -1;
+
+	/* The new fd is registered on its first wrapped call */
+	while(((ret = accept4(fd, addr, addrlen, SOCK_CLOEXEC)) < 0) && (errno == EAGAIN))
+		if(gt_io_wait(fdp, fd, GT_IO_READ))
+			return -1;
+
+	return ret;
+}
+
+extern int uthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	gt_io_fd_t *fdp;
+	int ret;
+
+	if(!(fdp = gt_io_fd(fd)))
+		return connect(fd, addr, addrlen);
+
+	if(!(fdp->flags & GT_IO_REGISTERED) && gt_io_register(fdp, fd))
+		return -1;
+
+	if(!(ret = connect(fd, addr, addrlen)) || (errno != EINPROGRESS))
+		return ret;
+
+	/* Writable once connected (or failed); connect again for the outcome */
+	do
+	{
+		if(gt_io_wait(fdp, fd, GT_IO_WRITE))
+			return -1;
+	} while(((ret = connect(fd, addr, addrlen)) < 0) && ((errno == EALREADY) || (errno == EINPROGRESS)));
+
+	return ((ret < 0) && (errno == EISCONN)) ? 0 : ret;
+}
+
+extern int uthread_close(int fd)
+{
+	kthread_context_t *k_ctx;
+	gt_io_fd_t *fdp;
+
+	if(!(fdp = gt_io_fd(fd)) || !(fdp->flags & GT_IO_REGISTERED))
+		return close(fd);
+
+	/* close drops the epoll registration; a reused fd number registers anew */
+	k_ctx = kthread_preempt_disable_current();
+	gt_spin_lock(&(fdp->lock));
+	assert(!fdp->reader && !fdp->writer);
+	fdp->flags = 0;
+	fdp->ready = 0;
+	fdp->k_ctx = NULL;
+	gt_spin_unlock(&(fdp->lock));
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+
+	return close(fd);
+}
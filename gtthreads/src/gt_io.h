@@ -0,0 +1,55 @@
+#ifndef __GT_IO_H
+#define __GT_IO_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/**********************************************************************/
+/* uthread I/O : per-kthread epoll reactor.
+ * An fd used through the wrappers below is made nonblocking and registered
+ * (edge-triggered) with the epoll set of the kthread that first used it.
+ * On EAGAIN the calling uthread parks on the fd; the reactor kthread polls
+ * its set from uthread_schedule and its idle loop and requeues the waiter
+ * on the kthread it parked on. Other uthreads keep running meanwhile.
+ * At most one reader and one writer may wait on an fd at a time.
+ * From main (not a uthread) the wrappers block in poll(2). */
+
+#define GT_IO_FD_PAGE_SHIFT 10 /* fd table : pages of 1024 entries */
+#define GT_IO_FD_PAGES 1024 /* fds up to 1M */
+#define GT_IO_EVENTS 64 /* epoll events per poll */
+
+/* gt_io_fd flags */
+#define GT_IO_REGISTERED 0x01 /* nonblocking, in the epoll set of 'k_ctx' */
+
+/* readiness (waits/ready) */
+#define GT_IO_READ 0x01
+#define GT_IO_WRITE 0x02
+
+typedef struct __gt_io_fd
+{
+	gt_spinlock_t lock; /* taken with preemption disabled */
+	int flags;
+	int ready; /* edges seen with nobody waiting (GT_IO_READ/WRITE) */
+	uthread_struct_t *reader; /* parked waiters */
+	uthread_struct_t *writer;
+	kthread_context_t *k_ctx; /* reactor kthread */
+} gt_io_fd_t;
+
+/* Called by kthread_init */
+extern int gt_io_init(kthread_context_t *k_ctx);
+
+/* Requeues the waiters of ready fds of this kthread's epoll set (no wait).
+ * Caller has preemption disabled. 'held' : fd lock the caller holds (a
+ * parking uthread's, see uthread_park) or NULL. Returns the number woken up. */
+extern int gt_io_poll(kthread_context_t *k_ctx, gt_spinlock_t *held);
+
+/**********************************************************************/
+/* uthread I/O api(s) : same results/errno as the system calls */
+extern ssize_t uthread_read(int fd, void *buf, size_t count);
+extern ssize_t uthread_write(int fd, const void *buf, size_t count);
+extern int uthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+extern int uthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+/* Must be used for fds that went through the wrappers (forgets the fd) */
+extern int uthread_close(int fd);
+
+#endif
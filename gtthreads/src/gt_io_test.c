@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* gt_io across kthreads : one uthread registers the read ends of a few
+ * pipes (its kthread becomes their reactor), one waiter per pipe parks
+ * on it while the reactor sleeps in kthread_idle, and a writer fills
+ * them later. Every waiter has to come back : a hang is a failure (run
+ * under a timeout). Exits 77 (skipped) when no waiter ended up off the
+ * reactor's kthread. */
+
+#define IO_TEST_KTHREADS 4
+#define IO_TEST_WAITERS 8
+#define IO_TEST_SKIP 77
+#define IO_TEST_SPIN_NS (2 * 1000000UL)
+
+static int pipe_fds[IO_TEST_WAITERS][2];
+
+static volatile int reactor_cpu = -1;
+static volatile long waiters_off;
+static volatile long failures;
+
+static int io_writer(void *arg)
+{
+	char byte = 'w';
+	int inx;
+
+	(void)arg;
+	/* Both the reactor and the waiters are asleep by now */
+	uthread_sleep_ns(100 * 1000000UL);
+	for(inx = 0; inx < IO_TEST_WAITERS; inx++)
+	{
+		if(write(pipe_fds[inx][1], &byte, 1) != 1)
+			__sync_fetch_and_add(&failures, 1);
+	}
+	return 0;
+}
+
+static int io_waiter(void *arg)
+{
+	int fd = (int)(long)arg;
+	unsigned long end;
+	char byte = 0;
+
+	/* Busy on the reactor's kthread : the waiters queued behind get
+	 * stolen (STEAL) */
+	if((int)kthread_current()->cpuid == reactor_cpu)
+	{
+		end = gt_timer_now() + IO_TEST_SPIN_NS;
+		while(gt_timer_now() < end)
+			;
+	}
+
+	/* Long enough for the reactor to go idle */
+	uthread_sleep_ns(20 * 1000000UL);
+
+	if((int)kthread_current()->cpuid != reactor_cpu)
+		__sync_fetch_and_add(&waiters_off, 1);
+	if((uthread_read(fd, &byte, 1) != 1) || (byte != 'w'))
+		__sync_fetch_and_add(&failures, 1);
+	return 0;
+}
+
+static int io_registrar(void *arg)
+{
+	char byte = 'r';
+	int inx;
+
+	(void)arg;
+	/* Registers the read ends here (data is there : no wait) */
+	for(inx = 0; inx < IO_TEST_WAITERS; inx++)
+	{
+		if((write(pipe_fds[inx][1], &byte, 1) != 1) || (uthread_read(pipe_fds[inx][0], &byte, 1) != 1))
+			__sync_fetch_and_add(&failures, 1);
+	}
+	reactor_cpu = kthread_current()->cpuid;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	kthread_sched_t sched;
+	uthread_t u_tid;
+	int inx;
+
+	if(argc != 2)
+	{
+		printf("Usage: io_test [0=PRIORITY/1=CREDIT/2=STEAL]\n");
+		exit(0);
+	}
+
+	switch(strtol(argv[1], NULL, 10))
+	{
+		case 0: sched = GT_SCHED_PRIORITY; break;
+		case 2: sched = GT_SCHED_STEAL; break;
+		default: sched = GT_SCHED_CREDIT; break;
+	}
+
+	for(inx = 0; inx < IO_TEST_WAITERS; inx++)
+	{
+		if(pipe(pipe_fds[inx]))
+		{
+			perror("pipe");
+			exit(1);
+		}
+	}
+
+	/* Whatever the cpu count (or DEBUG) would give */
+	gtthread_set_kthreads(IO_TEST_KTHREADS);
+	gtthread_app_init(sched);
+
+	/* main's own kthread only runs uthreads from gtthread_app_exit :
+	 * the registrar goes to (or is stolen by) another one */
+	uthread_create(&u_tid, io_registrar, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_detach(u_tid);
+	for(inx = 0; (inx < 1000) && (reactor_cpu < 0); inx++)
+		uthread_sleep_ns(1000000UL);
+
+	/* Placed round-robin, or stolen from main's kthread (STEAL) */
+	uthread_create(&u_tid, io_writer, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_detach(u_tid);
+	for(inx = 0; inx < IO_TEST_WAITERS; inx++)
+	{
+		uthread_create(&u_tid, io_waiter, (void *)(long)pipe_fds[inx][0], 0, UTHREAD_DEFAULT_CREDITS);
+		uthread_detach(u_tid);
+	}
+
+	gtthread_app_exit();
+
+	printf("reactor kthread %d, waiters on other kthreads %ld/%d%s, failures: %ld\n", reactor_cpu,
+			waiters_off, IO_TEST_WAITERS, waiters_off ? "" : " (not exercised)", failures);
+	if(failures)
+		return 1;
+	return (waiters_off ? 0 : IO_TEST_SKIP);
+}
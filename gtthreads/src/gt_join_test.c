@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* uthread_join / uthread_detach : a joiner creates workers that finish
+ * before and after it joins them, and checks every exit status. It also
+ * checks what has to fail : joining itself, a detached uthread, one
+ * joined already, and main joining a uthread that is not done. */
+
+#define JOIN_TEST_KTHREADS 4
+#define JOIN_TEST_WORKERS 16
+
+/* Negative ones too : the int goes through a void * */
+#define JOIN_TEST_STATUS(inx) (((inx) * 7) - 50)
+
+static uthread_t joiner_tid;
+static volatile int main_checked;
+static volatile long joined;
+static volatile long failures;
+
+static int join_worker(void *arg)
+{
+	int inx = (int)(long)arg;
+
+	/* Some are done before they are joined, some are waited for */
+	if(inx & 1)
+		uthread_sleep_ns((unsigned long)(inx % 4) * 2000000UL);
+	return JOIN_TEST_STATUS(inx);
+}
+
+static int join_joiner(void *arg)
+{
+	uthread_t u_tids[JOIN_TEST_WORKERS], u_tid;
+	void *u_status;
+	int inx;
+
+	(void)arg;
+	/* main first tries to join us */
+	while(!main_checked)
+		uthread_sleep_ns(1000000UL);
+
+	if(uthread_join(joiner_tid, &u_status) != -1)
+		__sync_fetch_and_add(&failures, 1);
+
+	for(inx = 0; inx < JOIN_TEST_WORKERS; inx++)
+		uthread_create(&u_tids[inx], join_worker, (void *)(long)inx, 0, UTHREAD_DEFAULT_CREDITS);
+
+	/* Detached : not joinable, done or not */
+	uthread_create(&u_tid, join_worker, (void *)0L, 0, UTHREAD_DEFAULT_CREDITS);
+	if(uthread_detach(u_tid) || (uthread_join(u_tid, &u_status) != -1) || (uthread_detach(u_tid) != -1))
+		__sync_fetch_and_add(&failures, 1);
+
+	/* Let the even ones finish first */
+	uthread_sleep_ns(1000000UL);
+
+	for(inx = 0; inx < JOIN_TEST_WORKERS; inx++)
+	{
+		u_status = NULL;
+		if(uthread_join(u_tids[inx], &u_status) || ((int)(long)u_status != JOIN_TEST_STATUS(inx)))
+		{
+			fprintf(stderr, "join of worker %d : status %d, expected %d\n", inx,
+					(int)(long)u_status, JOIN_TEST_STATUS(inx));
+			__sync_fetch_and_add(&failures, 1);
+			continue;
+		}
+		__sync_fetch_and_add(&joined, 1);
+	}
+
+	/* Joined already */
+	if(uthread_join(u_tids[0], &u_status) != -1)
+		__sync_fetch_and_add(&failures, 1);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	kthread_sched_t sched;
+	void *u_status;
+
+	if(argc != 2)
+	{
+		printf("Usage: join_test [0=PRIORITY/1=CREDIT/2=STEAL]\n");
+		exit(0);
+	}
+
+	switch(strtol(argv[1], NULL, 10))
+	{
+		case 0: sched = GT_SCHED_PRIORITY; break;
+		case 2: sched = GT_SCHED_STEAL; break;
+		default: sched = GT_SCHED_CREDIT; break;
+	}
+
+	gtthread_set_kthreads(JOIN_TEST_KTHREADS);
+	gtthread_app_init(sched);
+
+	uthread_create(&joiner_tid, join_joiner, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+
+	/* main can not wait : the joiner is not done */
+	if(uthread_join(joiner_tid, &u_status) != -1)
+		__sync_fetch_and_add(&failures, 1);
+	uthread_detach(joiner_tid);
+	main_checked = 1;
+
+	gtthread_app_exit();
+
+	printf("joined %ld/%d, failures: %ld\n", joined, JOIN_TEST_WORKERS, failures);
+	return ((failures || (joined != JOIN_TEST_WORKERS)) ? 1 : 0);
+}
@@ -11,6 +11,10 @@
 #include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <asm/prctl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "gt_include.h"
 
@@ -22,29 +26,38 @@
 
 /**********************************************************************/
 /* kthread context identification */
-kthread_context_t *kthread_cpu_map[GT_MAX_KTHREADS];
+kthread_context_t **kthread_cpu_map;
+unsigned int kthread_nr;
+
+/* gtthread_set_kthreads (0 : one per cpu) */
+static unsigned int kthread_nr_wanted;
 
 /* kthread schedule information */
 ksched_shared_info_t ksched_shared_info;
 
+/* GS slot seen by kthread_current() before kthread_init */
+static kthread_context_t *kthread_null_slot = NULL;
+
 /**********************************************************************/
 /* kthread */
 extern int kthread_create(kthread_t *tid, int (*start_fun)(void *), void *arg);
 static int kthread_handler(void *arg);
 static void kthread_init(kthread_context_t *k_ctx);
 static void kthread_exit();
+static void kthread_set_current(kthread_context_t **slot);
 
 /**********************************************************************/
 /* kthread schedule */
 static inline void ksched_info_init(ksched_shared_info_t *ksched_info, kthread_sched_t sched);
-void update_credit_balances(kthread_context_t *k_ctx);
 static void ksched_priority(int);
-static void ksched_cosched(int);
 extern kthread_runqueue_t *ksched_find_target(uthread_struct_t *);
+int kthread_done();
 
 /**********************************************************************/
 /* gtthread application (over kthreads and uthreads) */
 static void gtthread_app_start(void *arg);
+static void gtthread_app_lock_stats(void);
+static unsigned int *kthread_os_cpus(unsigned int *num_cpus);
 
 /**********************************************************************/
 /* kthread creation */
@@ -85,8 +98,8 @@ static int kthread_handler(void *arg)
 	kthread_init(k_ctx);
 	
 	#if DEBUG
-		fprintf(stderr, "kthread (tid : %u, pid : %u,  cpu : %d, cpu-apic-id %d) ready to run !!\n",
-			k_ctx->tid, k_ctx->pid, k_ctx->cpuid, k_ctx->cpu_apic_id);
+		fprintf(stderr, "kthread (tid : %u, pid : %u,  cpu : %d, os-cpu %d) ready to run !!\n",
+			k_ctx->tid, k_ctx->pid, k_ctx->cpuid, k_ctx->os_cpu);
 	#endif
 
 	k_ctx->kthread_app_func(NULL);
@@ -96,9 +109,42 @@ static int kthread_handler(void *arg)
 	return 0;
 }
 
+/* GS base : per kthread (clone copies the parent's, kthread_init resets it).
+ * glibc on x86-64 uses FS for TLS and leaves GS alone. */
+static void kthread_set_current(kthread_context_t **slot)
+{
+	if(syscall(SYS_arch_prctl, ARCH_SET_GS, (unsigned long)slot))
+	{
+		perror("arch_prctl(ARCH_SET_GS)");
+		exit(0);
+	}
+	return;
+}
+
+extern void kthread_clear_current(void)
+{
+	kthread_set_current(&kthread_null_slot);
+	return;
+}
+
+/* Runs at program load, so kthread_current() is NULL (and not a fault)
+ * until the main thread's kthread_init. */
+__attribute__((constructor)) static void kthread_current_boot(void)
+{
+	kthread_set_current(&kthread_null_slot);
+	return;
+}
+
 static void kthread_init(kthread_context_t *k_ctx)
 {
-	int cpu_affinity_mask, cur_cpu_apic_id;
+	/* Sized for os_cpu : a plain cpu_set_t stops at CPU_SETSIZE cpus */
+	size_t cpu_setsize = CPU_ALLOC_SIZE(k_ctx->os_cpu + 1);
+	unsigned long cpu_affinity_bits[cpu_setsize / sizeof(unsigned long)];
+	cpu_set_t *cpu_affinity_mask = (cpu_set_t *)cpu_affinity_bits;
+
+	/* First thing : a cloned kthread still has its parent's GS base */
+	k_ctx->kthread_self = k_ctx;
+	kthread_set_current(&(k_ctx->kthread_self));
 
 	/* cpuid and kthread_app_func are set by the application 
 	 * over kthread (eg. gtthread). */
@@ -106,8 +152,10 @@ static void kthread_init(kthread_context_t *k_ctx)
 	k_ctx->pid = syscall(SYS_getpid);
 	k_ctx->tid = syscall(SYS_gettid);
 
+	/* Not schedulable till the kthread enters its scheduling loop */
+	k_ctx->kthread_preempt_off = 1;
+
     k_ctx->kthread_sched_timer = ksched_priority;
-	k_ctx->kthread_sched_relay = ksched_cosched;
 
 	/* XXX: kthread runqueue balancing (TBD) */
 	k_ctx->kthread_runqueue_balance = NULL;
@@ -115,16 +163,39 @@ static void kthread_init(kthread_context_t *k_ctx)
 	/* Initialize kthread runqueue */
 
 	kthread_init_runqueue(&(k_ctx->krunqueue));
+	gt_stack_cache_init(&(k_ctx->kthread_stacks), UTHREAD_DEFAULT_SSIZE);
+	gt_heap_init(&(k_ctx->kthread_heap));
+	gt_timer_wheel_init(&(k_ctx->kthread_timers));
+	if(gt_io_init(k_ctx))
+	{
+		fprintf(stderr, "kthread(%d) epoll_create failed\n", k_ctx->cpuid);
+		exit(0);
+	}
+	gt_uring_init(&(k_ctx->kthread_uring));
+	if((k_ctx->kthread_wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+	{
+		fprintf(stderr, "kthread(%d) eventfd failed\n", k_ctx->cpuid);
+		exit(0);
+	}
 
-	cpu_affinity_mask = (1 << k_ctx->cpuid);
-	sched_setaffinity(k_ctx->tid,sizeof(unsigned long),(cpu_set_t *)&cpu_affinity_mask);
+	CPU_ZERO_S(cpu_setsize, cpu_affinity_mask);
+	CPU_SET_S(k_ctx->os_cpu, cpu_setsize, cpu_affinity_mask);
+	if(sched_setaffinity(k_ctx->tid, cpu_setsize, cpu_affinity_mask))
+		fprintf(stderr, "kthread(%d) affinity to cpu %u failed (errno:%d)\n", k_ctx->cpuid, k_ctx->os_cpu, errno);
 
 	sched_yield();
 
-	/* Scheduled on target cpu */
-	k_ctx->cpu_apic_id = kthread_apic_id();
+	kthread_cpu_map[k_ctx->cpuid] = k_ctx;
+
+	/* Scheduling signal handler is installed (and unblocked) once per kthread.
+	 * The handler only checks kthread_preempt_off on every tick. */
+	kthread_install_sighandler(SIGVTALRM, k_ctx->kthread_sched_timer);
 
-	kthread_cpu_map[k_ctx->cpu_apic_id] = k_ctx;
+	/* Ticks on this kthread's own cpu time */
+	k_ctx->kthread_timeslice_ns = ksched_shared_info.kthread_timeslice_ns;
+	k_ctx->kthread_timeslice_cputime = KTHREAD_TIMESLICE_ON_CPUTIME(k_ctx->kthread_timeslice_ns);
+	if(kthread_init_vtalrm_timeslice(&(k_ctx->kthread_timeslice), k_ctx->kthread_timeslice_ns))
+		fprintf(stderr, "kthread(%d) timeslice timer setup failed (errno:%d)\n", k_ctx->cpuid, errno);
 
 	return;
 }
@@ -140,11 +211,24 @@ static inline void kthread_exit()
 static inline void ksched_info_init(ksched_shared_info_t *ksched_info, kthread_sched_t sched)
 {
 	gt_spinlock_init(&(ksched_info->ksched_lock));
-	gt_spinlock_init(&(ksched_info->uthread_init_lock));
-	gt_spinlock_init(&(ksched_info->__malloc_lock));
 
 	ksched_info->scheduler = sched;
-    ksched_info->num_ticks = 0;
+	ksched_info->kthread_app_exiting = 0;
+
+	gt_spinlock_init(&(ksched_info->credit_lock));
+	TAILQ_INIT(&(ksched_info->credit_uthreads));
+	ksched_info->credit_acct_next = 0;
+	ksched_info->credit_acct_last = 0;
+	memset(ksched_info->credit_group_weight, 0, sizeof(ksched_info->credit_group_weight));
+
+	/* Unless gtthread_set_timeslice came first */
+	if(!ksched_info->kthread_timeslice_ns)
+	{
+		ksched_info->kthread_timeslice_min_ns = KTHREAD_VTALRM_USEC * 1000UL;
+		ksched_info->kthread_timeslice_max_ns = KTHREAD_VTALRM_USEC * 1000UL;
+		ksched_info->kthread_timeslice_ns = KTHREAD_VTALRM_USEC * 1000UL;
+	}
+	ksched_info->kthread_timeslice_next = 0;
 	
 	return;
 }
@@ -162,7 +246,7 @@ extern kthread_runqueue_t *ksched_find_target(uthread_struct_t *u_obj)
 	do
 	{
 		/* How dumb to assume there is atleast one cpu (haha) !! :-D */
-		target_cpu = ((target_cpu + 1) % GT_MAX_CORES);
+		target_cpu = ((target_cpu + 1) % kthread_nr);
 	} while(!kthread_cpu_map[target_cpu]);
 
 	gt_spin_lock(&(ksched_info->ksched_lock));
@@ -181,77 +265,205 @@ extern kthread_runqueue_t *ksched_find_target(uthread_struct_t *u_obj)
 	return(&(kthread_cpu_map[target_cpu]->krunqueue));
 }
 
-void update_credit_balances(kthread_context_t *k_ctx) {
-    /*
-     * Iterate over uthreads in the expired queue and add current timeslice credits.
-     *
-     * Also, perform credit deduction for CURRENT uthread
-     *
-     * TODO: if this does not work, try moving function to gt_pq?
-     */
-    kthread_runqueue_t *kthread_runq = &k_ctx->krunqueue;
-    runqueue_t *expires_runq = kthread_runq->expires_runq;
-    gt_spinlock_t *lock = &kthread_runq->kthread_runqlock;
-    uthread_head_t *u_head;
-	uthread_struct_t *u_thread;
-
-	// Bump credits for all uthreads in the active queue
-//	u_head = &kthread_runq->active_runq->prio_array[UTHREAD_CREDIT_UNDER].group[0];
-//	u_thread = TAILQ_FIRST(u_head);
-
-//	while (u_thread != NULL) {
-		// Bump up credit count for any active uthreads
-//        if (u_thread->uthread_state == UTHREAD_RUNNABLE)
-//            u_thread->uthread_credits += UTHREAD_DEFAULT_CREDITS;
-
-		// Get next uthread in queue
-//        u_thread = TAILQ_NEXT(u_thread, uthread_runq);
-//	}
-
-    // Get end of expired queue
-    u_head = &expires_runq->prio_array[UTHREAD_CREDIT_OVER].group[0];
-    u_thread = TAILQ_FIRST(u_head);
-
-    // Store pointer to original NEXT
-    uthread_struct_t *u_thread_next;
-
-    while (u_thread != NULL) {
-        // Keep pointer to NEXT
-        u_thread_next = TAILQ_NEXT(u_thread, uthread_runq);
-
-        // Bump up credit count of any expired uthreads
-		u_thread->uthread_credits = UTHREAD_DEFAULT_CREDITS;
-
-        // If OVER and credits > 0, move to active runq
-		// Remove from expired OVER queue
-		rem_from_runqueue(kthread_runq->expires_runq, lock, u_thread);
-
-		// Set to UNDER
-		u_thread->uthread_priority = UTHREAD_CREDIT_UNDER;
-
-		// Now as UNDER!
-		add_to_runqueue(kthread_runq->active_runq, lock, u_thread);
-
-        // Get next uthread in queue
-        u_thread = u_thread_next;
-    }
+/* Charged since the last accounting, or waiting for the cpu */
+static inline int ksched_credit_wants_cpu(uthread_struct_t *u_obj)
+{
+	return (u_obj->uthread_credit_active || (u_obj->uthread_credit_flags & UTHREAD_CREDIT_PARKED) ||
+			(u_obj->uthread_state & (UTHREAD_INIT | UTHREAD_RUNNABLE | UTHREAD_RUNNING)));
 }
 
-static void ksched_priority(int signo)
+extern int ksched_credit_account(void)
 {
-	/* [1] Tries to find the next schedulable uthread.
-	 * [2] Not Found - Sets uthread-select-criterion to NULL. Jump to [4].
-	 * [3] Found -  Sets uthread-select-criterion(if any) {Eg. uthread_group}.
-	 * [4] Announces uthread-select-criterion to other kthreads.
-	 * [5] Relays the scheduling signal to other kthreads. 
-	 * [RETURN] */
-	kthread_context_t *cur_k_ctx, *tmp_k_ctx;
-	int inx;
+	ksched_shared_info_t *ksched_info = &ksched_shared_info;
+	kthread_context_t *tmp_k_ctx;
+	uthread_struct_t *u_obj;
+	unsigned long group_weight[MAX_UTHREAD_GROUPS];
+	unsigned long now, next, period, elapsed, total, weight, share, limit;
+	long credits, new_credits;
+	unsigned int u_gid;
+	unsigned int inx;
+	int nkthreads = 0, nwoken = 0;
+
+	/* One clock read till the period is over */
+	now = gt_timer_now();
+	next = ksched_info->credit_acct_next;
+	if(now < next)
+		return 0;
+	period = GT_CREDIT_ACCT_SLICES * ksched_info->kthread_timeslice_max_ns;
+	if(!__sync_bool_compare_and_swap(&(ksched_info->credit_acct_next), next, now + period))
+		return 0;
+
+	/* Noticed at a tick, up to a timeslice late : hand out the time that
+	 * went by, or the weights drift towards an even split (at most two
+	 * periods, eg. after idling) */
+	elapsed = now - ksched_info->credit_acct_last;
+	if(elapsed > 2 * period)
+		elapsed = 2 * period;
+	ksched_info->credit_acct_last = now;
+
+	for(inx = 0; inx < kthread_nr; inx++)
+		if((tmp_k_ctx = kthread_cpu_map[inx]) && !(tmp_k_ctx->kthread_flags & KTHREAD_DONE))
+			nkthreads++;
+	total = (nkthreads ? nkthreads : 1) * elapsed;
+
+	gt_spin_lock(&(ksched_info->credit_lock));
+
+	/* Only the uthreads that want the cpu share it. Other kthreads change
+	 * their states meanwhile : the ones counted are marked. */
+	memset(group_weight, 0, sizeof(group_weight));
+	TAILQ_FOREACH(u_obj, &(ksched_info->credit_uthreads), uthread_credit_link)
+	{
+		if(!ksched_credit_wants_cpu(u_obj))
+			continue;
+		u_obj->uthread_credit_flags |= UTHREAD_CREDIT_COUNTED;
+		group_weight[u_obj->uthread_gid] += u_obj->uthread_weight;
+	}
 
-	// kthread_block_signal(SIGVTALRM);
-	// kthread_block_signal(SIGUSR1);
+	/* A weighted group shares as one uthread of its weight, the others
+	 * as their uthreads */
+	weight = 0;
+	for(u_gid = 0; u_gid < MAX_UTHREAD_GROUPS; u_gid++)
+	{
+		if(group_weight[u_gid] && ksched_info->credit_group_weight[u_gid])
+			weight += ksched_info->credit_group_weight[u_gid];
+		else
+			weight += group_weight[u_gid];
+	}
+
+	TAILQ_FOREACH(u_obj, &(ksched_info->credit_uthreads), uthread_credit_link)
+	{
+		if(!(u_obj->uthread_credit_flags & UTHREAD_CREDIT_COUNTED))
+			continue;
+		u_obj->uthread_credit_flags &= ~UTHREAD_CREDIT_COUNTED;
+		u_obj->uthread_credit_active = 0;
+
+		u_gid = u_obj->uthread_gid;
+		if(ksched_info->credit_group_weight[u_gid])
+			share = total * ksched_info->credit_group_weight[u_gid] / weight
+				* u_obj->uthread_weight / group_weight[u_gid];
+		else
+			share = total * u_obj->uthread_weight / weight;
+		if(u_obj->uthread_cap)
+		{
+			limit = elapsed * u_obj->uthread_cap / 100;
+			if(share > limit)
+				share = limit;
+		}
+
+		/* Its kthread charges it meanwhile. Neither a hoard nor a
+		 * debt outlives a period. */
+		do
+		{
+			credits = u_obj->uthread_credits;
+			new_credits = credits + (long)share;
+			if(new_credits > (long)period)
+				new_credits = period;
+			else if(new_credits < -(long)period)
+				new_credits = -(long)period;
+		} while(!__sync_bool_compare_and_swap(&(u_obj->uthread_credits), credits, new_credits));
+
+		/* Capped and paid back : to the inbox of its kthread */
+		if((u_obj->uthread_credit_flags & UTHREAD_CREDIT_PARKED) && (new_credits >= 0))
+		{
+			u_obj->uthread_credit_flags &= ~UTHREAD_CREDIT_PARKED;
+			ksched_info->credit_nparked--;
+			u_obj->uthread_state = UTHREAD_RUNNABLE;
+			u_obj->uthread_priority = UTHREAD_CREDIT_UNDER;
+			kthread_inbox_push(&(u_obj->uthread_kctx->krunqueue), u_obj);
+			nwoken++;
+		}
+	}
 
-	cur_k_ctx = kthread_cpu_map[kthread_apic_id()];
+	ksched_info->credit_epoch++;
+	gt_spin_unlock(&(ksched_info->credit_lock));
+
+	#if DEBUG
+	fprintf(stderr, "credit accounting : %lu ns over weight %lu (%d kthreads), %d unparked\n",
+			total, weight, nkthreads, nwoken);
+	#endif
+	return nwoken;
+}
+
+/* Halves the timeslice while uthreads wait for a kthread, doubles it
+ * while none does. Once per timeslice. */
+static void ksched_timeslice_adapt(ksched_shared_info_t *ksched_info)
+{
+	kthread_context_t *tmp_k_ctx;
+	kthread_runqueue_t *kthread_runq;
+	unsigned long now, next, slice, min_ns, max_ns;
+	unsigned int nrunnable = 0, nkthreads = 0;
+	unsigned int inx;
+
+	now = gt_timer_now();
+	next = ksched_info->kthread_timeslice_next;
+	if(now < next)
+		return;
+	slice = ksched_info->kthread_timeslice_ns;
+	if(!__sync_bool_compare_and_swap(&(ksched_info->kthread_timeslice_next), next, now + slice))
+		return;
+
+	/* Racy reads : a hint is all it takes */
+	for(inx = 0; inx < kthread_nr; inx++)
+	{
+		if(!(tmp_k_ctx = kthread_cpu_map[inx]) || (tmp_k_ctx->kthread_flags & KTHREAD_DONE))
+			continue;
+		kthread_runq = &(tmp_k_ctx->krunqueue);
+		nkthreads++;
+		nrunnable += kthread_runq->active_runq->uthread_tot + kthread_runq->expires_runq->uthread_tot
+			+ gt_deque_size(&(kthread_runq->kthread_deque)) + (kthread_runq->cur_uthread ? 1 : 0);
+	}
+
+	min_ns = ksched_info->kthread_timeslice_min_ns;
+	max_ns = ksched_info->kthread_timeslice_max_ns;
+	if(nrunnable > nkthreads)
+		slice = (slice / 2 < min_ns) ? min_ns : slice / 2;
+	else
+		slice = (slice * 2 > max_ns) ? max_ns : slice * 2;
+
+	#if DEBUG
+	if(slice != ksched_info->kthread_timeslice_ns)
+		fprintf(stderr, "timeslice %lu ns (%u runnable on %u kthreads)\n", slice, nrunnable, nkthreads);
+	#endif
+	ksched_info->kthread_timeslice_ns = slice;
+	return;
+}
+
+extern void ksched_timeslice_update(kthread_context_t *k_ctx)
+{
+	ksched_shared_info_t *ksched_info = &ksched_shared_info;
+	unsigned long slice;
+
+	if(ksched_info->kthread_timeslice_min_ns != ksched_info->kthread_timeslice_max_ns)
+		ksched_timeslice_adapt(ksched_info);
+
+	/* The kernel only lets a kthread arm its own timer */
+	slice = ksched_info->kthread_timeslice_ns;
+	if(slice == k_ctx->kthread_timeslice_ns)
+		return;
+
+	/* Across the tick : another clock, another timer */
+	if(KTHREAD_TIMESLICE_ON_CPUTIME(slice) != k_ctx->kthread_timeslice_cputime)
+	{
+		timer_delete(k_ctx->kthread_timeslice);
+		k_ctx->kthread_timeslice_ns = 0;
+		if(kthread_init_vtalrm_timeslice(&(k_ctx->kthread_timeslice), slice))
+			return;
+		k_ctx->kthread_timeslice_cputime = KTHREAD_TIMESLICE_ON_CPUTIME(slice);
+	}
+	else if(kthread_set_vtalrm_timeslice(k_ctx->kthread_timeslice, slice))
+		return;
+
+	k_ctx->kthread_timeslice_ns = slice;
+	return;
+}
+
+static void ksched_priority(int signo)
+{
+	/* Every kthread has its own timeslice timer (kthread_init) : the
+	 * tick is for this kthread only, nothing to relay. */
+	kthread_context_t *cur_k_ctx;
+
+	cur_k_ctx = kthread_current();
 
 	#if DEBUG
     if (cur_k_ctx->scheduler == GT_SCHED_PRIORITY)
@@ -260,73 +472,166 @@ static void ksched_priority(int signo)
         fprintf(stderr, "kthread(%d) entered credit scheduler!\n", cur_k_ctx->cpuid);
     #endif
 
-    // Perform credit updates for ALL kthreads once every N ticks
-//    if (ksched_shared_info.scheduler == GT_SCHED_CREDIT) {
-//        if (++ksched_shared_info.num_ticks == 10) {
-//            for (inx = 0; inx < GT_MAX_KTHREADS; inx++) {
-//                if ((tmp_k_ctx = kthread_cpu_map[inx])) {
-//                    update_credit_balances(tmp_k_ctx);
-//                }
-//                else {
-//                    break;
-//                }
-//            }
-//
-//            ksched_shared_info.num_ticks = 0;
-//        }
-//    }
-
-	/* Relay the signal to all other virtual processors(kthreads) */
-	for(inx=0; inx<GT_MAX_KTHREADS; inx++)
+	/* Already scheduling on this kthread; act on it when done */
+	if(cur_k_ctx->kthread_preempt_off)
 	{
-		/* XXX: We can avoid the last check (tmp to cur) by
-		 * temporarily marking cur as DONE. But chuck it !! */
-		if ((tmp_k_ctx = kthread_cpu_map[inx]) && (tmp_k_ctx != cur_k_ctx))
-		{
-			if(tmp_k_ctx->kthread_flags & KTHREAD_DONE)
-				continue;
-			/* tkill : send signal to specific threads */
-			syscall(__NR_tkill, tmp_k_ctx->tid, SIGUSR1);
-		}
+		cur_k_ctx->kthread_preempt_pending = 1;
+		return;
 	}
 
-    if (ksched_shared_info.scheduler == GT_SCHED_PRIORITY)
-	    uthread_schedule(&sched_find_best_uthread, 1);
-    else
-        uthread_schedule(&credit_find_best_uthread, 1);
+	uthread_reschedule(UTHREAD_SCHED_TIMER);
+
+	return;
+}
+
+/**********************************************************************/
+/* kthread idling */
+
+/* Anything that a sleeping kthread would miss. Runs after kthread_idle
+ * is announced : work queued later comes with a kick. */
+static int kthread_idle_work(kthread_context_t *k_ctx)
+{
+	kthread_runqueue_t *kthread_runq = &(k_ctx->krunqueue);
+	kthread_context_t *tmp_k_ctx;
+	unsigned int inx;
+
+	if(kthread_runq->inbox || kthread_runq->active_runq->uthread_tot
+			|| k_ctx->kthread_uring.pending || kthread_done())
+		return 1;
+
+	if(k_ctx->scheduler != GT_SCHED_STEAL)
+		return 0;
+
+	/* Something to steal */
+	for(inx = 0; inx < kthread_nr; inx++)
+	{
+		if((tmp_k_ctx = kthread_cpu_map[inx]) && gt_deque_size(&(tmp_k_ctx->krunqueue.kthread_deque)))
+			return 1;
+	}
+
+	return 0;
+}
+
+extern void kthread_idle(kthread_context_t *k_ctx)
+{
+	struct pollfd pfds[3];
+	struct timespec ts, *timeout = NULL;
+	unsigned long now, next, count;
+	int nfds = 0;
+
+	/* Spin a little first : work often shows up right away */
+	now = gt_timer_now();
+	if(!k_ctx->kthread_idle_since)
+		k_ctx->kthread_idle_since = now;
+	if((now - k_ctx->kthread_idle_since) < KTHREAD_IDLE_SPIN_NS)
+		return;
+
+	/* A tick caught while asleep is served by the next pass */
+	kthread_preempt_disable(k_ctx);
+
+	/* A timeslice on the monotonic clock would wake us up : off till the
+	 * next dispatch (ksched_timeslice_update) */
+	if(!k_ctx->kthread_timeslice_cputime && k_ctx->kthread_timeslice_ns)
+	{
+		kthread_set_vtalrm_timeslice(k_ctx->kthread_timeslice, 0);
+		k_ctx->kthread_timeslice_ns = 0;
+	}
+
+	pfds[nfds].fd = k_ctx->kthread_wakefd;
+	pfds[nfds].events = POLLIN;
+	pfds[nfds++].revents = 0;
+	if(k_ctx->kthread_uring.inflight)
+	{
+		pfds[nfds].fd = k_ctx->kthread_uring.ring_fd;
+		pfds[nfds].events = POLLIN;
+		pfds[nfds++].revents = 0;
+	}
+
+	/* Sleepers : the wheel has to turn. Capped uthreads : the next
+	 * accounting may put them back. */
+	next = gt_timer_next(&(k_ctx->kthread_timers));
+	if(ksched_shared_info.credit_nparked && (ksched_shared_info.credit_acct_next < next))
+		next = ksched_shared_info.credit_acct_next;
+	if(next != ~0UL)
+	{
+		next = (next > now) ? (next - now) : 0;
+		ts.tv_sec = next / 1000000000UL;
+		ts.tv_nsec = next % 1000000000UL;
+		timeout = &ts;
+	}
 
-	// kthread_unblock_signal(SIGVTALRM);
-	// kthread_unblock_signal(SIGUSR1);
+	k_ctx->kthread_idle = 1;
+	__sync_fetch_and_add(&(ksched_shared_info.kthread_nidle), 1);
 
+	/* Read once announced : waiters counted later kick us (gt_io_wait) */
+	if(k_ctx->kthread_io_waiters)
+	{
+		pfds[nfds].fd = k_ctx->kthread_epfd;
+		pfds[nfds].events = POLLIN;
+		pfds[nfds++].revents = 0;
+	}
+
+	if(!kthread_idle_work(k_ctx))
+		ppoll(pfds, nfds, timeout, NULL);
+
+	k_ctx->kthread_idle = 0;
+	__sync_fetch_and_sub(&(ksched_shared_info.kthread_nidle), 1);
+
+	/* Kicks are counted : take them all */
+	if(pfds[0].revents & POLLIN)
+		read(k_ctx->kthread_wakefd, &count, sizeof(count));
+
+	k_ctx->kthread_idle_since = 0;
+	kthread_preempt_enable(k_ctx);
 	return;
 }
 
-static void ksched_cosched(int signal)
+extern void kthread_kick(kthread_context_t *k_ctx)
 {
-	/* [1] Reads the uthread-select-criterion set by schedule-master.
-	 * [2] Read NULL. Jump to [5]
-	 * [3] Tries to find a matching uthread.
-	 * [4] Found - Jump to [FOUND]
-	 * [5] Tries to find the best uthread (by DEFAULT priority method) 
-	 * [6] Found - Jump to [FOUND]
-	 * [NOT FOUND] Return.
-	 * [FOUND] Return. 
-	 * [[NOTE]] {uthread_select_criterion == match_uthread_group_id} */
-
-	// kthread_block_signal(SIGVTALRM);
-	// kthread_block_signal(SIGUSR1);
-
-	/* This virtual processor (thread) was not
-	 * picked by kernel for vtalrm signal.
-	 * USR1 signal has been relayed to it. */
-
-    if (ksched_shared_info.scheduler == GT_SCHED_PRIORITY)
-        uthread_schedule(&sched_find_best_uthread, 1);
-    else
-        uthread_schedule(&credit_find_best_uthread, 1);
+	unsigned long one = 1;
+
+	/* Awake : it sees the work on its next pass */
+	if(!k_ctx->kthread_idle)
+		return;
+
+	/* One kick per sleep */
+	if(__sync_bool_compare_and_swap(&(k_ctx->kthread_idle), 1, 0))
+		write(k_ctx->kthread_wakefd, &one, sizeof(one));
+	return;
+}
 
-	// kthread_unblock_signal(SIGVTALRM);
-	// kthread_unblock_signal(SIGUSR1);
+extern void kthread_kick_idle(kthread_context_t *k_ctx)
+{
+	kthread_context_t *tmp_k_ctx;
+	unsigned int inx;
+
+	__sync_synchronize();
+	if(!ksched_shared_info.kthread_nidle)
+		return;
+
+	for(inx = 0; inx < kthread_nr; inx++)
+	{
+		if((tmp_k_ctx = kthread_cpu_map[inx]) && (tmp_k_ctx != k_ctx) && tmp_k_ctx->kthread_idle)
+		{
+			kthread_kick(tmp_k_ctx);
+			return;
+		}
+	}
+	return;
+}
+
+extern void kthread_kick_all(void)
+{
+	kthread_context_t *tmp_k_ctx;
+	unsigned int inx;
+
+	__sync_synchronize();
+	if(!ksched_shared_info.kthread_nidle)
+		return;
+
+	for(inx = 0; inx < kthread_nr; inx++)
+		if((tmp_k_ctx = kthread_cpu_map[inx]))
+			kthread_kick(tmp_k_ctx);
 	return;
 }
 
@@ -336,42 +641,60 @@ static void ksched_cosched(int signal)
  * All application cleanup must be done at the end of this function. */
 extern unsigned int gtthread_app_running;
 
+/* No uthread left, and main creates no more (till then, the uthreads
+ * created so far may all be done before main creates the next one) */
 int kthread_done() {
-    return ksched_shared_info.kthread_tot_uthreads && !ksched_shared_info.kthread_cur_uthreads;
+    return ksched_shared_info.kthread_app_exiting
+        && ksched_shared_info.kthread_tot_uthreads && !ksched_shared_info.kthread_cur_uthreads;
 }
 
 static void gtthread_app_start(void *arg)
 {
 	kthread_context_t *k_ctx;
 
-	k_ctx = kthread_cpu_map[kthread_apic_id()];
-	assert((k_ctx->cpu_apic_id == kthread_apic_id()));
+	k_ctx = kthread_current();
+	assert(k_ctx == kthread_cpu_map[k_ctx->cpuid]);
 
 	#if DEBUG
 		fprintf(stderr, "kthread (%d) ready to schedule\n", k_ctx->cpuid);
 	#endif
 
+	/* Leave the not-yet-schedulable state set by kthread_init */
+	kthread_preempt_enable(k_ctx);
+
 	// Current kthread keeps looping and scheduling uthreads until complete
 	// This is the main kthread loop (except for kthread 0)!
 	while(!kthread_done())
 	{
 		__asm__ __volatile__ ("pause\n");
 
-        if(sigsetjmp(k_ctx->kthread_env, 0))
+        if(gt_context_save(&(k_ctx->kthread_ctx)))
 		{
-			/* siglongjmp to this point is done when there
+			/* gt_context_restore to this point is done when there
 			 * are no more uthreads to schedule.*/
 			/* XXX: gtthread app cleanup has to be done. */
+			uthread_switch_finish(); /* paired with uthread_schedule */
+			kthread_idle(k_ctx); /* nothing to run */
             continue;
 		}
 
         // Only perform eager scheduling in PRIORITY mode!
+        // (or when sleepers/io waiters woke up)
         if (k_ctx->scheduler == GT_SCHED_PRIORITY)
-		    uthread_schedule(&sched_find_best_uthread, 1);
+		    uthread_schedule(&sched_find_best_uthread, UTHREAD_SCHED_TIMER);
+        else if (k_ctx->scheduler == GT_SCHED_STEAL)
+            uthread_schedule(&steal_find_best_uthread, UTHREAD_SCHED_TIMER); /* steals when idle */
+        else if (uthread_idle_poll())
+            uthread_schedule(&credit_find_best_uthread, UTHREAD_SCHED_TIMER);
+        else
+            kthread_idle(k_ctx);
 //        else
 //            uthread_schedule(&credit_find_best_uthread);
 	}
 
+	/* No context to come back to */
+	kthread_preempt_disable(k_ctx);
+
 //    fprintf(stderr, "Quitting kthread (%d)\n", k_ctx->cpuid);
     k_ctx->kthread_flags |= KTHREAD_DONE;
 	
@@ -380,41 +703,77 @@ static void gtthread_app_start(void *arg)
 	return;
 }
 
+/* The cpus this process may run on, in order (one kthread each).
+ * Sized by the kernel's configured cpus, not by CPU_SETSIZE. */
+static unsigned int *kthread_os_cpus(unsigned int *num_cpus)
+{
+	unsigned int conf_cpus, cpu, *os_cpus;
+	size_t cpu_setsize;
+	cpu_set_t *cpu_mask;
+
+	if((conf_cpus = (unsigned int)sysconf(_SC_NPROCESSORS_CONF)) < 1)
+		conf_cpus = 1;
+	os_cpus = (unsigned int *)MALLOC_SAFE(conf_cpus * sizeof(unsigned int));
+
+	cpu_setsize = CPU_ALLOC_SIZE(conf_cpus);
+	cpu_mask = CPU_ALLOC(conf_cpus);
+	if(!cpu_mask || sched_getaffinity(0, cpu_setsize, cpu_mask))
+	{
+		/* All of them then */
+		for(cpu = 0; cpu < conf_cpus; cpu++)
+			os_cpus[cpu] = cpu;
+		*num_cpus = conf_cpus;
+	}
+	else
+	{
+		*num_cpus = 0;
+		for(cpu = 0; cpu < conf_cpus; cpu++)
+			if(CPU_ISSET_S(cpu, cpu_setsize, cpu_mask))
+				os_cpus[(*num_cpus)++] = cpu;
+	}
+	if(cpu_mask)
+		CPU_FREE(cpu_mask);
+
+	return os_cpus;
+}
+
 extern void gtthread_app_init(kthread_sched_t sched)
 {
 	kthread_context_t *k_ctx, *k_ctx_main;
 	kthread_t k_tid;
-	unsigned int num_cpus, inx;
+	unsigned int num_cpus, num_os_cpus, inx;
+	unsigned int *os_cpus;
 
     /* Num of logical processors (cpus/cores) */
+    os_cpus = kthread_os_cpus(&num_os_cpus);
+    num_cpus = num_os_cpus;
     #if DEBUG
         num_cpus = 1;
-    #else
-       num_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
     #endif
 
+	/* Asked for : pinned round-robin over the cpus */
+	if(kthread_nr_wanted)
+		num_cpus = kthread_nr_wanted;
+
     fprintf(stderr, "Number of cores: %d\n", num_cpus);
+
+	kthread_nr = num_cpus;
+	kthread_cpu_map = (kthread_context_t **)MALLOCZ_SAFE(num_cpus * sizeof(kthread_context_t *));
 	
 	/* Initialize shared schedule information */
 	ksched_info_init(&ksched_shared_info, sched);
 
+	/* Helper OS threads : from main, before any kthread shares its TLS */
+	gt_blocking_init();
+
 	/* kthread (virtual processor) on the first logical processor */
 	k_ctx_main = (kthread_context_t *)MALLOCZ_SAFE(sizeof(kthread_context_t));
 	k_ctx_main->cpuid = 0;
+	k_ctx_main->os_cpu = os_cpus[0];
 	k_ctx_main->kthread_app_func = &gtthread_app_start;
 	k_ctx_main->scheduler = sched;
 	kthread_init(k_ctx_main);
 
-	// Setup timer and provide a timer handler
-	int err = kthread_init_vtalrm_timeslice();
-	if (err != 0)
-		fprintf(stderr, "Virtual timer setup failed!\n");
-	
-	kthread_install_sighandler(SIGVTALRM, k_ctx_main->kthread_sched_timer);
-
-	// Relays to other kthreads that it's time to schedule a uthread
-	kthread_install_sighandler(SIGUSR1, k_ctx_main->kthread_sched_relay);
-
 //    fprintf(stderr, "Setup kthread(0) and timers!\n");
 
 	/* kthreads (virtual processors) on all other logical processors */
@@ -422,6 +781,7 @@ extern void gtthread_app_init(kthread_sched_t sched)
 	{
 		k_ctx = (kthread_context_t *)MALLOCZ_SAFE(sizeof(kthread_context_t));
 		k_ctx->cpuid = inx;
+		k_ctx->os_cpu = os_cpus[inx % num_os_cpus];
 		k_ctx->kthread_app_func = &gtthread_app_start;
 		k_ctx->scheduler = sched;
 		
@@ -437,11 +797,11 @@ extern void gtthread_app_init(kthread_sched_t sched)
 
 	{
 		/* yield till other kthreads initialize */
-		int init_done;
+		unsigned int init_done;
 yield_again:
 		sched_yield();
 		init_done = 0;
-		for(inx=0; inx<GT_MAX_KTHREADS; inx++)
+		for(inx=0; inx<kthread_nr; inx++)
 		{
 			/* XXX: We can avoid the last check (tmp to cur) by
 			 * temporarily marking cur as DONE. But chuck it !! */
@@ -452,6 +812,7 @@ yield_again:
 		if(init_done < num_cpus)
 			goto yield_again;
 	}
+	FREE_SAFE(os_cpus);
 
 #if 0
 	/* app-func is called for main in gthread_app_exit */
@@ -462,11 +823,11 @@ yield_again:
 
 int kthreads_done() {
     int done = ~0;
-	int inx;
+	unsigned int inx;
 
-    for (inx = 0; inx < GT_MAX_KTHREADS; inx++) {
+    for (inx = 0; inx < kthread_nr; inx++) {
         if (!kthread_cpu_map[inx])
-            break;
+            continue;
 
         done = done & kthread_cpu_map[inx]->kthread_flags;
     }
@@ -480,39 +841,122 @@ extern void gtthread_app_exit()
 	/* For main thread, trigger start again. */
 	kthread_context_t *k_ctx;
 
-	k_ctx = kthread_cpu_map[kthread_apic_id()];
+	k_ctx = kthread_current();
 	k_ctx->kthread_flags &= ~KTHREAD_DONE;
 
+	/* Sleeping kthreads may have run out of uthreads already */
+	ksched_shared_info.kthread_app_exiting = 1;
+	kthread_kick_all();
+
+	/* Main context turns into kthread(0)'s scheduling loop */
+	kthread_preempt_enable(k_ctx);
+
 	while (!kthreads_done())
 	{
 		__asm__ __volatile__ ("pause\n");
-		if(sigsetjmp(k_ctx->kthread_env, 0))
+		if(gt_context_save(&(k_ctx->kthread_ctx)))
 		{
-			/* siglongjmp to this point is done when there
+			/* gt_context_restore to this point is done when there
 			 * are no more uthreads to schedule.*/
 			/* XXX: gtthread app cleanup has to be done. */
+			uthread_switch_finish(); /* paired with uthread_schedule */
+			kthread_idle(k_ctx); /* nothing to run */
 			continue;
 		}
 
-//        kthread_install_sighandler(SIGVTALRM, k_ctx->kthread_sched_timer);
-
         if (ksched_shared_info.scheduler == GT_SCHED_PRIORITY)
-		    uthread_schedule(&sched_find_best_uthread, 1);
+		    uthread_schedule(&sched_find_best_uthread, UTHREAD_SCHED_TIMER);
+        else if (ksched_shared_info.scheduler == GT_SCHED_STEAL)
+            uthread_schedule(&steal_find_best_uthread, UTHREAD_SCHED_TIMER);
+        else if (uthread_idle_poll() || kthread_done())
+            /* Done : a pass with nothing to run marks kthread(0) DONE (no
+             * tick to count on, an idle kthread disarms a monotonic one) */
+            uthread_schedule(&credit_find_best_uthread, UTHREAD_SCHED_TIMER);
+        else
+            kthread_idle(k_ctx);
 	}
 
+	kthread_preempt_disable(k_ctx);
+
 //    fprintf(stderr, "Quitting kthread (%d)\n", k_ctx->cpuid);
 
 	kthread_block_signal(SIGVTALRM);
-	kthread_block_signal(SIGUSR1);
+	timer_delete(k_ctx->kthread_timeslice);
 
 	while(ksched_shared_info.kthread_cur_uthreads)
 	{
 		/* Main thread has to wait for other kthreads */
 		__asm__ __volatile__ ("pause\n");
 	}
+
+	gtthread_app_lock_stats();
 	return;	
 }
 
+extern int gtthread_set_kthreads(unsigned int nkthreads)
+{
+	/* Too late once the table is sized */
+	if(kthread_cpu_map)
+		return -1;
+
+	kthread_nr_wanted = nkthreads;
+	return 0;
+}
+
+extern int gtthread_set_timeslice(unsigned long usec)
+{
+	ksched_shared_info_t *ksched_info = &ksched_shared_info;
+
+	if((usec < KTHREAD_TIMESLICE_MIN_USEC) || (usec > KTHREAD_TIMESLICE_MAX_USEC))
+		return -1;
+
+	ksched_info->kthread_timeslice_min_ns = usec * 1000UL;
+	ksched_info->kthread_timeslice_max_ns = usec * 1000UL;
+	ksched_info->kthread_timeslice_ns = usec * 1000UL;
+	return 0;
+}
+
+extern int gtthread_set_timeslice_adaptive(unsigned long min_usec, unsigned long max_usec)
+{
+	ksched_shared_info_t *ksched_info = &ksched_shared_info;
+	unsigned long slice;
+
+	if((min_usec < KTHREAD_TIMESLICE_MIN_USEC) || (max_usec > KTHREAD_TIMESLICE_MAX_USEC) || (min_usec > max_usec))
+		return -1;
+
+	/* Starts from the current timeslice, within the new bounds */
+	slice = ksched_info->kthread_timeslice_ns;
+	if(slice < min_usec * 1000UL)
+		slice = min_usec * 1000UL;
+	else if(slice > max_usec * 1000UL)
+		slice = max_usec * 1000UL;
+
+	ksched_info->kthread_timeslice_min_ns = min_usec * 1000UL;
+	ksched_info->kthread_timeslice_max_ns = max_usec * 1000UL;
+	ksched_info->kthread_timeslice_ns = slice;
+	return 0;
+}
+
+/* GT_SPINLOCK_STATS : which scheduler lock is hot */
+static void gtthread_app_lock_stats(void)
+{
+#if GT_SPINLOCK_STATS
+	kthread_context_t *tmp_k_ctx;
+	char name[32];
+	unsigned int inx;
+
+	gt_spinlock_stats_print("ksched_lock", &(ksched_shared_info.ksched_lock));
+	for(inx = 0; inx < kthread_nr; inx++)
+	{
+		if(!(tmp_k_ctx = kthread_cpu_map[inx]))
+			continue;
+		snprintf(name, sizeof(name), "kthread(%d) runqlock", tmp_k_ctx->cpuid);
+		gt_spinlock_stats_print(name, &(tmp_k_ctx->krunqueue.kthread_runqlock));
+	}
+#endif
+	return;
+}
+
 /**********************************************************************/
 /* Main Test */
 
@@ -557,7 +1001,7 @@ int main()
 static int func(void *arg)
 {
 	unsigned int count;
-	kthread_context_t *k_ctx = kthread_cpu_map[kthread_apic_id()];
+	kthread_context_t *k_ctx = kthread_current();
 #define u_info ((uthread_arg_t *)arg)
 	printf("Thread (id:%d, group:%d, cpu:%d) created\n", u_info->num1, u_info->num2, k_ctx->cpuid);
 	count = 0;
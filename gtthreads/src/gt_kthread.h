@@ -2,9 +2,7 @@
 #define __GT_KTHREAD_H
 
 #include <stdlib.h>
-
-#define GT_MAX_CORES	16
-#define GT_MAX_KTHREADS GT_MAX_CORES
+#include <stddef.h>
 
 typedef unsigned int kthread_t;
 
@@ -12,40 +10,62 @@ typedef unsigned int kthread_t;
 	Types of schedulers supported by the library:
 		- PRIORITY: O(1) priority scheduler
 		- CREDIT: Xen's credit scheduler
+		- STEAL: per-kthread work-stealing deques (gt_deque.h), FIFO, no priorities
 */ 
 typedef enum {
 	GT_SCHED_PRIORITY = 0,
-	GT_SCHED_CREDIT
+	GT_SCHED_CREDIT,
+	GT_SCHED_STEAL
 } kthread_sched_t;
 
 /**********************************************************************/
 /* kthread_context */
 
 /* kthread flags */
-#define KTHREAD_DONE 0x01 /* Done scheduling. Don't relay signal to this kthread. */
+#define KTHREAD_DONE 0x01 /* Done scheduling. */
 
 typedef struct __kthread_context
 {
-	unsigned int cpuid;
-	unsigned int cpu_apic_id;
+	struct __kthread_context *kthread_self; /* MUST be first : read through %gs:0 (kthread_current) */
+
+	unsigned int cpuid; /* logical id : slot in kthread_cpu_map (0 .. kthread_nr - 1) */
+	unsigned int os_cpu; /* os cpu number it is pinned to */
 	unsigned int pid;
 	unsigned int tid;
 
 	unsigned int kthread_flags;
-	kthread_sched_t scheduler; /* Selected scheduler (PRIORITY or CREDIT) */
+	kthread_sched_t scheduler; /* Selected scheduler (PRIORITY, CREDIT or STEAL) */
 	void (*kthread_app_func)(void *); /* kthread application function */
 	void (*kthread_sched_timer)(int); /* vtalrm signal handler */
-	void (*kthread_sched_relay)(int); /* relay(usr1) signal handler*/
+	timer_t kthread_timeslice; /* timeslice timer of this kthread, raises vtalrm */
+	unsigned long kthread_timeslice_ns; /* armed on kthread_timeslice (ksched_timeslice_update), 0 : disarmed */
+	int kthread_timeslice_cputime; /* kthread_timeslice is on the cpu time clock (else monotonic) */
+
+	volatile int kthread_preempt_off; /* nesting count : >0 while scheduling (signals are only recorded) */
+	volatile int kthread_preempt_pending; /* scheduling signal arrived while preempt_off */
 
 	void (*kthread_runqueue_balance)(); /* balance across kthread runqueues */
-	sigjmp_buf kthread_env; /* kthread's env to jump to (when done scheduling) */
+	gt_context_t kthread_ctx; /* kthread's context to jump to (when done scheduling) */
 
 	kthread_runqueue_t krunqueue;
+	gt_stack_cache_t kthread_stacks; /* uthread stacks mapped/cached by this kthread */
+	uthread_cache_t kthread_uthreads; /* free uthread structs cached by this kthread */
+	gt_heap_t kthread_heap; /* gt_malloc arena of this kthread */
+	gt_timer_wheel_t kthread_timers; /* sleeping uthreads of this kthread */
+	int kthread_epfd; /* epoll set of the fds registered by this kthread (gt_io) */
+	volatile int kthread_io_waiters; /* uthreads parked on those fds */
+	gt_uring_t kthread_uring; /* file I/O submitted by uthreads of this kthread */
+
+	int kthread_wakefd; /* eventfd this kthread sleeps on when idle (kthread_idle) */
+	volatile int kthread_idle; /* sleeping : kick it (kthread_kick) */
+	unsigned long kthread_idle_since; /* ns, 0 : not idle */
 } kthread_context_t;
 
 
-/* kthread to cpu context mapping */
-extern kthread_context_t *kthread_cpu_map[];
+/* kthreads by logical id, kthread_nr slots (sized by gtthread_app_init).
+ * A slot stays NULL till its kthread_init : scans skip the holes. */
+extern kthread_context_t **kthread_cpu_map;
+extern unsigned int kthread_nr;
 /**********************************************************************/
 
 /* XXX: Move to gt_sched.[ch] */
@@ -65,67 +85,160 @@ typedef struct __ksched_shared_info
 	unsigned int kthread_tot_uthreads; /* (M) : Set if atleast one uthread was created */
 	unsigned int kthread_cur_uthreads; /* (M) : Current uthreads (over all kthreads) */
 
-	unsigned short last_ugroup_kthread[MAX_UTHREAD_GROUPS]; /* (M) : Target cpu for next uthread from group */
+	unsigned int last_ugroup_kthread[MAX_UTHREAD_GROUPS]; /* (M) : Target kthread (logical id) for next uthread from group */
 
 	gt_spinlock_t ksched_lock; /* global lock for updating above counters */
-	gt_spinlock_t uthread_init_lock; /* global lock for uthread_init (to serialize signal handling stuff in there) */
 
 	kthread_sched_t scheduler; // Type of scheduler, accessible on uthread creation
-	unsigned int num_ticks; // Number of credit sched ticks -- used for bumping
 
-	gt_spinlock_t __malloc_lock; /* making malloc thread-safe (check particular glibc to see if needed) */
-	unsigned int reserved[2];
+	/* GT_SCHED_CREDIT accounting (ksched_credit_account) */
+	gt_spinlock_t credit_lock; /* credit_uthreads, credit flags of the uthreads */
+	uthread_head_t credit_uthreads; /* (M) : live uthreads, linked through uthread_credit_link */
+	volatile unsigned long credit_acct_next; /* (M) : ns, next accounting (claimed with a CAS) */
+	unsigned long credit_acct_last; /* ns, last accounting (its CAS winner) */
+	volatile unsigned int credit_epoch; /* (S) : accountings done (runqs re-sort their OVER level) */
+	volatile unsigned int credit_nparked; /* (M) : capped uthreads waiting for an accounting */
+	unsigned int credit_group_weight[MAX_UTHREAD_GROUPS]; /* (M) : 0 : the group's uthreads share on their own */
+
+	/* Timeslice (gtthread_set_timeslice). Adaptive between min and max,
+	 * fixed if they are equal. */
+	volatile unsigned long kthread_timeslice_ns; /* (M) : the kthreads arm it at their next scheduling */
+	volatile unsigned long kthread_timeslice_min_ns; /* (M) */
+	volatile unsigned long kthread_timeslice_max_ns; /* (M) */
+	volatile unsigned long kthread_timeslice_next; /* (M) : ns, next adaptive decision (claimed with a CAS) */
+
+	volatile unsigned int kthread_nidle; /* (M) : kthreads sleeping in kthread_idle (atomic) */
+	volatile unsigned int kthread_app_exiting; /* (S) : main is in gtthread_app_exit, creates no more */
 } ksched_shared_info_t;
 
 
 extern ksched_shared_info_t ksched_shared_info;
 
+/**********************************************************************/
+/* GT_SCHED_CREDIT (Xen style).
+ * A uthread is charged the cpu time (ns) it used each time it is switched
+ * out; below zero credits it is OVER and runs after every UNDER uthread
+ * (migrating one from another kthread first). Every accounting period the
+ * first kthread to notice hands out the cpu time since the last one
+ * (kthreads * elapsed) to the live uthreads, in proportion to their
+ * weights, limited by their caps and by one period of credits. A group with a weight of its
+ * own (uthread_group_set_credits) gets its share as a whole, split among
+ * its uthreads by their weights. Woken up uthreads with credits left are
+ * BOOSTed till they are charged. */
+#define GT_CREDIT_ACCT_SLICES 3 /* accounting period, in timeslices (the longest one if adaptive) */
+
+/* Accounts if the period is over (any kthread, preemption disabled).
+ * Returns the number of capped uthreads put back on a runq. */
+extern int ksched_credit_account(void);
+
+/* Re-arms the calling kthread's timer if the timeslice changed; adapts the
+ * timeslice first if due (any kthread, preemption disabled). */
+extern void ksched_timeslice_update(kthread_context_t *k_ctx);
+
 /**********************************************************************/
 /* create a kthread */
 extern int kthread_create(kthread_t *tid, int (*start_fun)(void *), void *arg);
 
 /**********************************************************************/
-/* apic-id of the cpu on which kthread is running (kthread_cpu_map) */
-static inline unsigned char kthread_apic_id(void)
+/* Current kthread context : one load.
+ * kthread_init points this kthread's GS base at its context, whose first
+ * field points back at itself. Before that, GS points at a NULL slot
+ * (set up at program load), so this returns NULL. */
+static inline kthread_context_t *kthread_current(void)
 {
-/* IO APIC id is unique for a core and can be used as cpuid. 
- * EBX[31:24] Bits 24-31 (8 bits) return the 8-bit unique.
- * Initial APIC ID for the processor this code is running on.*/
-#define INITIAL_APIC_ID_BITS  0xFF000000
+	kthread_context_t *k_ctx;
 
+	__asm__ __volatile__ ("movq %%gs:0, %0\n"
+				:"=r" (k_ctx));
+	return k_ctx;
+}
 
-	unsigned int Regebx = 0;
+/* For OS threads that are not kthreads (eg. gt_blocking helpers) : they
+ * inherit their creator's GS base. kthread_current() returns NULL after. */
+extern void kthread_clear_current(void);
 
-	__asm__ __volatile__ (
-		"movl $1, %%eax\n\t"
-		"cpuid"
-		:"=b" (Regebx)
-		: :"%eax","%ecx","%edx");
+/**********************************************************************/
+/* kthread preemption control.
+ * Scheduling signals (VTALRM) that arrive while preemption is off
+ * are only recorded in kthread_preempt_pending. No syscalls involved. */
+/* inc/dec are single instructions, so a signal never sees a torn count */
+static inline void kthread_preempt_disable(kthread_context_t *k_ctx)
+{
+	__asm__ __volatile__ ("incl %0\n"
+				:"+m" (k_ctx->kthread_preempt_off)
+				:
+				:"memory", "cc");
+}
 
-	return((unsigned char)((Regebx & INITIAL_APIC_ID_BITS) >> 24));
-#undef INITIAL_APIC_ID_BITS
+/* Disables preemption of the running kthread and returns it.
+ * kthread_current() then kthread_preempt_disable() leaves a window : a
+ * signal in between may move the uthread to another kthread, which would
+ * then bump (and work under) the count of the one it left. A single
+ * instruction through %gs has none. */
+static inline kthread_context_t *kthread_preempt_disable_current(void)
+{
+	__asm__ __volatile__ ("incl %%gs:%c0\n"
+				:
+				:"i" (offsetof(kthread_context_t, kthread_preempt_off))
+				:"memory", "cc");
+	return kthread_current();
 }
 
+/* Returns (and clears) the pending flag once the count drops to 0.
+ * Caller reschedules if set. */
+static inline int kthread_preempt_enable(kthread_context_t *k_ctx)
+{
+	unsigned char enabled;
+	int pending;
+
+	__asm__ __volatile__ ("decl %0\n\t"
+				"sete %1\n"
+				:"+m" (k_ctx->kthread_preempt_off), "=q" (enabled)
+				:
+				:"memory", "cc");
+	if(!enabled)
+		return 0;
+
+	if((pending = k_ctx->kthread_preempt_pending))
+		k_ctx->kthread_preempt_pending = 0;
+	return pending;
+}
 
 /**********************************************************************/
-/* Thread-safe malloc */
+/* kthread idling.
+ * A kthread without work keeps polling for KTHREAD_IDLE_SPIN_NS, then
+ * sleeps on its eventfd (and on its epoll set / io_uring while uthreads
+ * wait on them, and till gt_timer_next while uthreads sleep).
+ * Whoever queues work for a sleeping kthread kicks it. */
+#define KTHREAD_IDLE_SPIN_NS 50000
+
+/* Called by the scheduling loop after a pass found nothing to run */
+extern void kthread_idle(kthread_context_t *k_ctx);
+/* Wakes k_ctx up if it sleeps. Caller has published the work with a
+ * locked instruction (eg. kthread_inbox_push). */
+extern void kthread_kick(kthread_context_t *k_ctx);
+/* Work on k_ctx others can take (GT_SCHED_STEAL) : wakes one sleeper */
+extern void kthread_kick_idle(kthread_context_t *k_ctx);
+/* No uthread left : every kthread has to see it */
+extern void kthread_kick_all(void);
+
+/**********************************************************************/
+/* Thread-safe malloc (per-kthread arenas, see gt_malloc.h; no global lock) */
 static inline void *MALLOC_SAFE(unsigned int size)
 {
-	void *__ptr;
-	gt_spin_lock(&(ksched_shared_info.__malloc_lock));
-	__ptr = malloc(size);
-	gt_spin_unlock(&(ksched_shared_info.__malloc_lock));
-	return(__ptr);
+	return(gt_malloc(size));
 }
 
 /* Zeroes out allocated bytes */
 static inline void *MALLOCZ_SAFE(unsigned int size)
 {
-	void *__ptr;
-	gt_spin_lock(&(ksched_shared_info.__malloc_lock));
-	__ptr = calloc(1, size);
-	gt_spin_unlock(&(ksched_shared_info.__malloc_lock));
-	return(__ptr);
+	return(gt_calloc(1, size));
+}
+
+static inline void FREE_SAFE(void *ptr)
+{
+	gt_free(ptr);
+	return;
 }
 
 /**********************************************************************/
@@ -133,4 +246,20 @@ static inline void *MALLOCZ_SAFE(unsigned int size)
 extern void gtthread_app_init(kthread_sched_t sched);
 extern void gtthread_app_exit();
 
+/* Number of kthreads gtthread_app_init starts (0 : one per cpu this
+ * process may run on, the default). More kthreads than cpus share them,
+ * pinned round-robin. Before gtthread_app_init only, else -1. */
+extern int gtthread_set_kthreads(unsigned int nkthreads);
+
+/* Timeslice of every kthread (us of cpu time; of wall time below
+ * KTHREAD_TIMESLICE_CPUTIME_USEC), from the next scheduling point on.
+ * Before or after gtthread_app_init. -1 out of
+ * [KTHREAD_TIMESLICE_MIN_USEC, KTHREAD_TIMESLICE_MAX_USEC]. */
+extern int gtthread_set_timeslice(unsigned long usec);
+/* Adaptive timeslice between min_usec and max_usec : halved while more
+ * uthreads are runnable than kthreads (latency), doubled while each
+ * kthread has one at most (throughput, fewer ticks). Decided once per
+ * timeslice. gtthread_set_timeslice makes it fixed again. */
+extern int gtthread_set_timeslice_adaptive(unsigned long min_usec, unsigned long max_usec);
+
 #endif
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/**********************************************************************/
+/* Every span (and every large mapping) starts with this header.
+ * gt_free finds it by masking the block address. */
+#define GT_MALLOC_LARGE ((unsigned int)-1)
+
+typedef struct __gt_malloc_span
+{
+	gt_heap_t *heap; /* owner heap (small spans) */
+	unsigned int size_class; /* GT_MALLOC_LARGE for a large mapping */
+	unsigned int reserved;
+	unsigned long map_size; /* large mapping size */
+} gt_malloc_span_t;
+
+#define GT_MALLOC_SPAN(ptr) \
+	((gt_malloc_span_t *)((unsigned long)(ptr) & ~(GT_MALLOC_SPAN_SIZE - 1UL)))
+
+/* Used by threads without a kthread context : main before kthread_init,
+ * gt_blocking helpers. They may run together : under gt_boot_lock. */
+static gt_heap_t gt_boot_heap;
+static gt_spinlock_t gt_boot_lock;
+
+/**********************************************************************/
+static void *gt_malloc_map_aligned(unsigned long size);
+static void *gt_heap_alloc_large(unsigned long size);
+static void *gt_heap_alloc(gt_heap_t *heap, unsigned long size);
+static void gt_heap_free(gt_heap_t *heap, void *ptr);
+
+/**********************************************************************/
+/* Mapping aligned to GT_MALLOC_SPAN_SIZE (trims the slop) */
+static void *gt_malloc_map_aligned(unsigned long size)
+{
+	unsigned long map, aligned;
+
+	map = (unsigned long)mmap(NULL, size + GT_MALLOC_SPAN_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if((void *)map == MAP_FAILED)
+		return NULL;
+
+	aligned = (map + GT_MALLOC_SPAN_SIZE - 1) & ~(GT_MALLOC_SPAN_SIZE - 1UL);
+	if(aligned > map)
+		munmap((void *)map, aligned - map);
+	munmap((void *)(aligned + size), (map + size + GT_MALLOC_SPAN_SIZE) - (aligned + size));
+
+	return (void *)aligned;
+}
+
+static void *gt_heap_alloc_large(unsigned long size)
+{
+	gt_malloc_span_t *span;
+	unsigned long map_size;
+
+	map_size = (size + GT_MALLOC_SPAN_HDR + 4095) & ~4095UL;
+	if(!(span = (gt_malloc_span_t *)gt_malloc_map_aligned(map_size)))
+		return NULL;
+
+	span->heap = NULL;
+	span->size_class = GT_MALLOC_LARGE;
+	span->map_size = map_size;
+
+	return (char *)span + GT_MALLOC_SPAN_HDR;
+}
+
+static void *gt_heap_alloc(gt_heap_t *heap, unsigned long size)
+{
+	gt_malloc_class_t *mclass;
+	gt_malloc_block_t *block, *next;
+	gt_malloc_span_t *span;
+	unsigned int inx;
+
+	if(size > GT_MALLOC_MAX_SMALL)
+		return gt_heap_alloc_large(size);
+
+	/* Smallest class that fits */
+	for(inx = 0; (1UL << (GT_MALLOC_MIN_SHIFT + inx)) < size; inx++)
+		;
+	mclass = &(heap->classes[inx]);
+
+	if(!mclass->free_blocks && mclass->remote_free)
+	{
+		/* Take over everything other kthreads freed */
+		block = __sync_lock_test_and_set(&(mclass->remote_free), NULL);
+		for(; block; block = next)
+		{
+			next = block->next;
+			block->next = mclass->free_blocks;
+			mclass->free_blocks = block;
+		}
+	}
+
+	if((block = mclass->free_blocks))
+	{
+		mclass->free_blocks = block->next;
+		return block;
+	}
+
+	if(mclass->bump >= mclass->bump_end)
+	{
+		/* Carve a new span for this class */
+		if(!(span = (gt_malloc_span_t *)gt_malloc_map_aligned(GT_MALLOC_SPAN_SIZE)))
+			return NULL;
+
+		span->heap = heap;
+		span->size_class = inx;
+		span->map_size = GT_MALLOC_SPAN_SIZE;
+
+		mclass->bump = (char *)span + GT_MALLOC_SPAN_HDR;
+		mclass->bump_end = (char *)span + GT_MALLOC_SPAN_SIZE -
+			(1UL << (GT_MALLOC_MIN_SHIFT + inx)) + 1;
+	}
+
+	block = (gt_malloc_block_t *)mclass->bump;
+	mclass->bump += (1UL << (GT_MALLOC_MIN_SHIFT + inx));
+	return block;
+}
+
+/* heap : caller's heap */
+static void gt_heap_free(gt_heap_t *heap, void *ptr)
+{
+	gt_malloc_span_t *span = GT_MALLOC_SPAN(ptr);
+	gt_malloc_class_t *mclass;
+	gt_malloc_block_t *block = (gt_malloc_block_t *)ptr;
+	gt_malloc_block_t *head;
+
+	if(span->size_class == GT_MALLOC_LARGE)
+	{
+		munmap(span, span->map_size);
+		return;
+	}
+
+	mclass = &(span->heap->classes[span->size_class]);
+
+	if(span->heap == heap)
+	{
+		block->next = mclass->free_blocks;
+		mclass->free_blocks = block;
+		return;
+	}
+
+	/* Remote free : lock-free push onto the owner's class */
+	do
+	{
+		head = mclass->remote_free;
+		block->next = head;
+	} while(!__sync_bool_compare_and_swap(&(mclass->remote_free), head, block));
+
+	return;
+}
+
+/**********************************************************************/
+extern void gt_heap_init(gt_heap_t *heap)
+{
+	memset(heap, 0, sizeof(gt_heap_t));
+	return;
+}
+
+extern void *gt_malloc(unsigned long size)
+{
+	kthread_context_t *k_ctx;
+	void *ptr;
+
+	if(!size)
+		size = 1;
+
+	if(!(k_ctx = kthread_current()))
+	{
+		gt_spin_lock(&gt_boot_lock);
+		ptr = gt_heap_alloc(&gt_boot_heap, size);
+		gt_spin_unlock(&gt_boot_lock);
+		return ptr;
+	}
+
+	k_ctx = kthread_preempt_disable_current();
+	ptr = gt_heap_alloc(&(k_ctx->kthread_heap), size);
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+
+	return ptr;
+}
+
+extern void *gt_calloc(unsigned long nmemb, unsigned long size)
+{
+	void *ptr;
+
+	if(size && (nmemb > ((unsigned long)-1) / size))
+		return NULL;
+
+	if((ptr = gt_malloc(nmemb * size)))
+		memset(ptr, 0, nmemb * size);
+
+	return ptr;
+}
+
+extern void gt_free(void *ptr)
+{
+	kthread_context_t *k_ctx;
+
+	if(!ptr)
+		return;
+
+	if(!(k_ctx = kthread_current()))
+	{
+		gt_spin_lock(&gt_boot_lock);
+		gt_heap_free(&gt_boot_heap, ptr);
+		gt_spin_unlock(&gt_boot_lock);
+		return;
+	}
+
+	k_ctx = kthread_preempt_disable_current();
+	gt_heap_free(&(k_ctx->kthread_heap), ptr);
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+
+	return;
+}
@@ -0,0 +1,45 @@
+#ifndef __GT_MALLOC_H
+#define __GT_MALLOC_H
+
+/**********************************************************************/
+/* Per-kthread arena allocator.
+ * Small requests are served from power-of-two size classes carved out of
+ * 64KB spans owned by one kthread (no lock, preemption disabled). A block
+ * freed by another kthread is pushed on the owner's lock-free remote_free
+ * list and taken back in one xchg when the owner runs dry.
+ * Large requests get their own mapping. */
+
+#define GT_MALLOC_SPAN_SIZE (64 * 1024) /* spans are aligned to their size */
+#define GT_MALLOC_SPAN_HDR 64 /* keeps blocks 16-byte aligned */
+#define GT_MALLOC_MIN_SHIFT 4 /* smallest class : 16 bytes */
+#define GT_MALLOC_NUM_CLASSES 10 /* 16 .. 8192 bytes */
+#define GT_MALLOC_MAX_SMALL (1UL << (GT_MALLOC_MIN_SHIFT + GT_MALLOC_NUM_CLASSES - 1))
+
+typedef struct __gt_malloc_block
+{
+	struct __gt_malloc_block *next;
+} gt_malloc_block_t;
+
+typedef struct __gt_malloc_class
+{
+	gt_malloc_block_t *free_blocks; /* owner only */
+	char *bump; /* next uncarved block in the current span */
+	char *bump_end;
+	gt_malloc_block_t * volatile remote_free; /* freed by other kthreads */
+} gt_malloc_class_t;
+
+typedef struct __gt_heap
+{
+	gt_malloc_class_t classes[GT_MALLOC_NUM_CLASSES];
+} gt_heap_t;
+
+extern void gt_heap_init(gt_heap_t *heap);
+
+/**********************************************************************/
+/* gt-malloc api(s) : usable from any uthread (or main) without a global lock.
+ * Threads without a kthread context share one heap, under a lock. */
+extern void *gt_malloc(unsigned long size);
+extern void *gt_calloc(unsigned long nmemb, unsigned long size);
+extern void gt_free(void *ptr);
+
+#endif
@@ -25,10 +25,10 @@ static matrix_t *generate_matrix(int size, int val) {
     int i, j;
 
     // Allocate a matrix
-    matrix_t *m = (matrix_t *)MALLOC_SAFE(sizeof(matrix_t));
+    matrix_t *m = (matrix_t *)gt_malloc(sizeof(matrix_t));
 
     // Allocate entire matrix as single block
-    m->arr = (int *)MALLOC_SAFE(size * size * sizeof(int));
+    m->arr = (int *)gt_malloc(size * size * sizeof(int));
 
     int *row;
 
@@ -59,14 +59,14 @@ static void print_matrix(matrix_t *mat)
 	return;
 }
 
-static void uthread_mulmat(void *p)
+static int uthread_mulmat(void *p)
 {
 	int i, j, k;
 	unsigned int cpuid;
 
 #define ptr ((uthread_arg_t *)p)
 
-	kthread_context_t *k_ctx = kthread_cpu_map[kthread_apic_id()];
+	kthread_context_t *k_ctx = kthread_current();
 
 	#if DEBUG
 	fprintf(stderr, "Thread(id:%d, group:%d, cpu:%d) started\n",ptr->tid, ptr->gid, cpuid);
@@ -96,12 +96,13 @@ static void uthread_mulmat(void *p)
 			ptr->tid, ptr->credits, ptr->_A->rows, cpuid, ptr->runtime.tv_sec, ptr->runtime.tv_usec);
     #endif
 #undef ptr
+	return 0;
 }
 
 void free_matrix(matrix_t *m) {
 	if (m) {
-		free(m->arr);
-    	free(m);
+		gt_free(m->arr);
+    	gt_free(m);
 	}
 }
 
@@ -117,13 +118,16 @@ int main(int argc, char **argv)
         long v = strtol(argv[1], NULL, 10);
 
         if (v == 0) sched = GT_SCHED_PRIORITY;
+        else if (v == 2) sched = GT_SCHED_STEAL;
         else sched = GT_SCHED_CREDIT;
     } else {
-        printf("Usage: matrix [0=PRIORITY/1=CREDIT]\n");
+        printf("Usage: matrix [0=PRIORITY/1=CREDIT/2=STEAL]\n");
         exit(0);
     }
 
-    if (sched)
+    if (sched == GT_SCHED_STEAL)
+        printf("Scheduler: STEAL\n");
+    else if (sched)
         printf("Scheduler: CREDIT\n");
     else
         printf("Scheduler: PRIORITY\n");
@@ -169,7 +173,6 @@ int main(int argc, char **argv)
 
 				uarg->tid = (unsigned)idx;
 				uarg->gid = 0;
-                uarg->used_time = 0;
 				uarg->credits = credits;
                 uarg->size = size;
 
@@ -210,7 +213,8 @@ int main(int argc, char **argv)
     for (i = 0; i < 4; i++) {
         size = matrix_sizes[i];
 
-        for (j = 0; j < 4; j++) {
+        // Same order as the uthreads were created in
+        for (j = 3; j >= 0; j--) {
             credits = credit_values[j];
 
             // Compute mean of runs for *this* set
@@ -219,7 +223,6 @@ int main(int argc, char **argv)
             for (k = 0; k < (NUM_THREADS/16); k++) {
                 // uthread elapsed time in s
                 runtime = uargs[idx + k].runtime.tv_sec + (uargs[idx + k].runtime.tv_usec / 1000000.0);
-//                runtime = uargs[idx + k].used_time / 1000000.0;
                 mean += runtime;
             }
 
@@ -230,7 +233,6 @@ int main(int argc, char **argv)
 
             for (k = 0; k < (NUM_THREADS/16); k++) {
                 runtime = uargs[idx + k].runtime.tv_sec + (uargs[idx + k].runtime.tv_usec / 1000000.0);
-//                runtime = uargs[idx + k].used_time / 1000000.0;
                 stdev += pow(fabs(runtime - mean), 2);
             }
 
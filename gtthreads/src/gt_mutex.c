@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/**********************************************************************/
+/* gt_mutex */
+
+extern int gt_mutex_init(gt_mutex_t *mutex)
+{
+	if(!mutex)
+		return -1;
+
+	gt_spinlock_init(&(mutex->lock));
+	mutex->locked = 0;
+	mutex->owner = NULL;
+	TAILQ_INIT(&(mutex->waiters));
+	return 0;
+}
+
+extern int gt_mutex_lock(gt_mutex_t *mutex)
+{
+	kthread_context_t *k_ctx;
+	uthread_struct_t *u_self;
+
+	while(1)
+	{
+		k_ctx = kthread_preempt_disable_current();
+		u_self = k_ctx->krunqueue.cur_uthread;
+		gt_spin_lock(&(mutex->lock));
+
+		if(!mutex->locked)
+		{
+			mutex->locked = 1;
+			mutex->owner = u_self;
+			gt_spin_unlock(&(mutex->lock));
+			if(kthread_preempt_enable(k_ctx))
+				uthread_preempt_resched();
+			return 0;
+		}
+
+		if(u_self)
+			break;
+
+		/* main : nothing to park */
+		gt_spin_unlock(&(mutex->lock));
+		kthread_preempt_enable(k_ctx);
+		__asm__ __volatile__ ("pause\n");
+	}
+
+	TAILQ_INSERT_TAIL(&(mutex->waiters), u_self, uthread_runq);
+	uthread_park(&(mutex->lock));
+
+	/* gt_mutex_unlock handed us the mutex */
+	assert(mutex->owner == u_self);
+	return 0;
+}
+
+extern int gt_mutex_trylock(gt_mutex_t *mutex)
+{
+	kthread_context_t *k_ctx;
+	int ret = -1;
+
+	k_ctx = kthread_preempt_disable_current();
+	gt_spin_lock(&(mutex->lock));
+	if(!mutex->locked)
+	{
+		mutex->locked = 1;
+		mutex->owner = k_ctx->krunqueue.cur_uthread;
+		ret = 0;
+	}
+	gt_spin_unlock(&(mutex->lock));
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+
+	return ret;
+}
+
+extern int gt_mutex_unlock(gt_mutex_t *mutex)
+{
+	kthread_context_t *k_ctx;
+	uthread_struct_t *u_obj;
+	int ret = 0;
+
+	k_ctx = kthread_preempt_disable_current();
+	gt_spin_lock(&(mutex->lock));
+
+	if(!mutex->locked)
+		ret = -1;
+	else if((u_obj = TAILQ_FIRST(&(mutex->waiters))))
+	{
+		/* Handoff : stays locked, no window for a third uthread */
+		TAILQ_REMOVE(&(mutex->waiters), u_obj, uthread_runq);
+		mutex->owner = u_obj;
+		uthread_wakeup(u_obj);
+	}
+	else
+	{
+		mutex->locked = 0;
+		mutex->owner = NULL;
+	}
+
+	gt_spin_unlock(&(mutex->lock));
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+
+	return ret;
+}
+
+/**********************************************************************/
+/* gt_cond */
+
+extern int gt_cond_init(gt_cond_t *cond)
+{
+	if(!cond)
+		return -1;
+
+	gt_spinlock_init(&(cond->lock));
+	TAILQ_INIT(&(cond->waiters));
+	return 0;
+}
+
+extern int gt_cond_wait(gt_cond_t *cond, gt_mutex_t *mutex)
+{
+	kthread_context_t *k_ctx;
+	uthread_struct_t *u_self;
+
+	k_ctx = kthread_preempt_disable_current();
+	if(!(u_self = k_ctx->krunqueue.cur_uthread))
+	{
+		kthread_preempt_enable(k_ctx);
+		return -1;
+	}
+
+	/* Queued before the mutex is released : a signal can not be missed */
+	gt_spin_lock(&(cond->lock));
+	TAILQ_INSERT_TAIL(&(cond->waiters), u_self, uthread_runq);
+	gt_mutex_unlock(mutex);
+	uthread_park(&(cond->lock));
+
+	return gt_mutex_lock(mutex);
+}
+
+static int gt_cond_wakeup(gt_cond_t *cond, int all)
+{
+	kthread_context_t *k_ctx;
+	uthread_struct_t *u_obj;
+
+	k_ctx = kthread_preempt_disable_current();
+	gt_spin_lock(&(cond->lock));
+	while((u_obj = TAILQ_FIRST(&(cond->waiters))))
+	{
+		TAILQ_REMOVE(&(cond->waiters), u_obj, uthread_runq);
+		uthread_wakeup(u_obj);
+		if(!all)
+			break;
+	}
+	gt_spin_unlock(&(cond->lock));
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+
+	return 0;
+}
+
+extern int gt_cond_signal(gt_cond_t *cond)
+{
+	return gt_cond_wakeup(cond, 0);
+}
+
+extern int gt_cond_broadcast(gt_cond_t *cond)
+{
+	return gt_cond_wakeup(cond, 1);
+}
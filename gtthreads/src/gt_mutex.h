@@ -0,0 +1,42 @@
+#ifndef __GT_MUTEX_H
+#define __GT_MUTEX_H
+
+/**********************************************************************/
+/* uthread mutex and condition variable.
+ * A uthread that has to wait is parked on the object's wait queue (through
+ * uthread_runq, it is in no runq meanwhile) and the kthread runs something
+ * else. The internal spinlock is only held with preemption disabled, so a
+ * preempted uthread never holds it. */
+
+typedef struct __gt_mutex
+{
+	gt_spinlock_t lock; /* protects everything below */
+	int locked;
+	uthread_struct_t *owner; /* NULL when held by main */
+	uthread_head_t waiters; /* FIFO */
+} gt_mutex_t;
+
+typedef struct __gt_cond
+{
+	gt_spinlock_t lock;
+	uthread_head_t waiters; /* FIFO */
+} gt_cond_t;
+
+extern int gt_mutex_init(gt_mutex_t *mutex);
+/* Parks the caller while the mutex is held. main (not a uthread) spins. */
+extern int gt_mutex_lock(gt_mutex_t *mutex);
+/* 0 on success, -1 if the mutex is held */
+extern int gt_mutex_trylock(gt_mutex_t *mutex);
+/* Ownership is handed to the first waiter, which is requeued on the kthread
+ * it parked on. -1 if the mutex is not locked. */
+extern int gt_mutex_unlock(gt_mutex_t *mutex);
+
+extern int gt_cond_init(gt_cond_t *cond);
+/* Releases 'mutex' and parks till signalled, then takes 'mutex' again.
+ * Only a uthread can wait (-1 otherwise). */
+extern int gt_cond_wait(gt_cond_t *cond, gt_mutex_t *mutex);
+/* Wakes up the first (all) waiter(s). */
+extern int gt_cond_signal(gt_cond_t *cond);
+extern int gt_cond_broadcast(gt_cond_t *cond);
+
+#endif
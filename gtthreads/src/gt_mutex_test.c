@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* gt_mutex_t / gt_cond_t : uthreads on several kthreads bump a counter
+ * under a mutex, giving up the cpu inside the critical section; no two
+ * may ever be in it together and no increment may be lost. Then a
+ * producer hands items to consumers through a one-slot buffer guarded
+ * by two condition variables; every item has to arrive exactly once. */
+
+#define MUTEX_TEST_KTHREADS 4
+#define MUTEX_TEST_UTHREADS 16
+#define MUTEX_TEST_LOOPS 200
+
+#define MUTEX_TEST_CONSUMERS 4
+#define MUTEX_TEST_ITEMS 2000
+
+static gt_mutex_t counter_mutex;
+static unsigned long counter;
+static volatile long inside;
+
+static gt_mutex_t slot_mutex;
+static gt_cond_t slot_full, slot_empty;
+static long slot; /* 0 : empty, -1 : no more items */
+static volatile long items_sum, items_nr;
+
+static volatile long failures;
+
+static int mutex_adder(void *arg)
+{
+	unsigned long value;
+	int inx;
+
+	(void)arg;
+	for(inx = 0; inx < MUTEX_TEST_LOOPS; inx++)
+	{
+		gt_mutex_lock(&counter_mutex);
+		if(__sync_fetch_and_add(&inside, 1))
+			__sync_fetch_and_add(&failures, 1);
+
+		/* Not atomic : only the mutex keeps it right */
+		value = counter;
+		if(!(inx % 8))
+			uthread_yield();
+		counter = value + 1;
+
+		__sync_fetch_and_sub(&inside, 1);
+		gt_mutex_unlock(&counter_mutex);
+	}
+	return 0;
+}
+
+static int mutex_consumer(void *arg)
+{
+	long item;
+
+	(void)arg;
+	while(1)
+	{
+		gt_mutex_lock(&slot_mutex);
+		while(!slot)
+			gt_cond_wait(&slot_full, &slot_mutex);
+		if((item = slot) < 0)
+		{
+			/* Left there for the other consumers */
+			gt_mutex_unlock(&slot_mutex);
+			break;
+		}
+		slot = 0;
+		gt_cond_signal(&slot_empty);
+		gt_mutex_unlock(&slot_mutex);
+
+		__sync_fetch_and_add(&items_sum, item);
+		__sync_fetch_and_add(&items_nr, 1);
+	}
+	return 0;
+}
+
+static int mutex_producer(void *arg)
+{
+	long item;
+
+	(void)arg;
+	for(item = 1; item <= MUTEX_TEST_ITEMS; item++)
+	{
+		gt_mutex_lock(&slot_mutex);
+		while(slot)
+			gt_cond_wait(&slot_empty, &slot_mutex);
+		slot = item;
+		gt_cond_signal(&slot_full);
+		gt_mutex_unlock(&slot_mutex);
+	}
+
+	gt_mutex_lock(&slot_mutex);
+	while(slot)
+		gt_cond_wait(&slot_empty, &slot_mutex);
+	slot = -1;
+	gt_cond_broadcast(&slot_full);
+	gt_mutex_unlock(&slot_mutex);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	kthread_sched_t sched;
+	uthread_t u_tid;
+	int inx;
+
+	if(argc != 2)
+	{
+		printf("Usage: mutex_test [0=PRIORITY/1=CREDIT/2=STEAL]\n");
+		exit(0);
+	}
+
+	switch(strtol(argv[1], NULL, 10))
+	{
+		case 0: sched = GT_SCHED_PRIORITY; break;
+		case 2: sched = GT_SCHED_STEAL; break;
+		default: sched = GT_SCHED_CREDIT; break;
+	}
+
+	gt_mutex_init(&counter_mutex);
+	gt_mutex_init(&slot_mutex);
+	gt_cond_init(&slot_full);
+	gt_cond_init(&slot_empty);
+
+	gtthread_set_kthreads(MUTEX_TEST_KTHREADS);
+	gtthread_app_init(sched);
+
+	/* Held : trylock fails. Not held : unlock fails. */
+	if(gt_mutex_lock(&counter_mutex) || (gt_mutex_trylock(&counter_mutex) != -1) ||
+		gt_mutex_unlock(&counter_mutex) || (gt_mutex_unlock(&counter_mutex) != -1))
+		__sync_fetch_and_add(&failures, 1);
+
+	for(inx = 0; inx < MUTEX_TEST_UTHREADS; inx++)
+	{
+		uthread_create(&u_tid, mutex_adder, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+		uthread_detach(u_tid);
+	}
+	for(inx = 0; inx < MUTEX_TEST_CONSUMERS; inx++)
+	{
+		uthread_create(&u_tid, mutex_consumer, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+		uthread_detach(u_tid);
+	}
+	uthread_create(&u_tid, mutex_producer, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_detach(u_tid);
+
+	gtthread_app_exit();
+
+	if(counter != (MUTEX_TEST_UTHREADS * MUTEX_TEST_LOOPS))
+		__sync_fetch_and_add(&failures, 1);
+	if((items_nr != MUTEX_TEST_ITEMS) || (items_sum != ((long)MUTEX_TEST_ITEMS * (MUTEX_TEST_ITEMS + 1) / 2)))
+		__sync_fetch_and_add(&failures, 1);
+
+	printf("counter %lu/%d, items %ld/%d (sum %ld), failures: %ld\n", counter,
+			MUTEX_TEST_UTHREADS * MUTEX_TEST_LOOPS, items_nr, MUTEX_TEST_ITEMS, items_sum, failures);
+	return (failures ? 1 : 0);
+}
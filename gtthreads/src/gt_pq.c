@@ -9,6 +9,7 @@
 #include <setjmp.h>
 #include <errno.h>
 #include <assert.h>
+#include <stddef.h>
 
 #include "gt_include.h"
 
@@ -105,7 +106,6 @@ extern void init_runqueue(runqueue_t *runq)
 extern void add_to_runqueue(runqueue_t *runq, gt_spinlock_t *runq_lock, uthread_struct_t *u_elem)
 {
 	gt_spin_lock(runq_lock);
-	runq_lock->holder = 0x02;
 
     if (u_elem != NULL)
 	    __add_to_runqueue(runq, u_elem);
@@ -114,10 +114,25 @@ extern void add_to_runqueue(runqueue_t *runq, gt_spinlock_t *runq_lock, uthread_
 	return;
 }
 
+extern void add_list_to_runqueue(runqueue_t *runq, gt_spinlock_t *runq_lock, uthread_head_t *u_list)
+{
+	uthread_struct_t *u_elem;
+
+	gt_spin_lock(runq_lock);
+
+	while((u_elem = TAILQ_FIRST(u_list)))
+	{
+		TAILQ_REMOVE(u_list, u_elem, uthread_runq);
+		__add_to_runqueue(runq, u_elem);
+	}
+
+	gt_spin_unlock(runq_lock);
+	return;
+}
+
 extern void rem_from_runqueue(runqueue_t *runq, gt_spinlock_t *runq_lock, uthread_struct_t *u_elem)
 {
 	gt_spin_lock(runq_lock);
-	runq_lock->holder = 0x03;
 
     if (u_elem != NULL)
 	    __rem_from_runqueue(runq, u_elem);
@@ -147,9 +162,55 @@ extern void kthread_init_runqueue(kthread_runqueue_t *kthread_runq)
 	init_runqueue(kthread_runq->expires_runq);
 
 	TAILQ_INIT(&(kthread_runq->zombie_uthreads));
+
+	gt_deque_init(&(kthread_runq->kthread_deque));
+	kthread_runq->steal_seed = (unsigned int)((unsigned long)kthread_runq >> 6) | 1;
+	kthread_runq->inbox = NULL;
 	return;
 }
 
+/**********************************************************************/
+/* kthread inbox */
+
+extern void kthread_inbox_push(kthread_runqueue_t *kthread_runq, uthread_struct_t *u_elem)
+{
+	uthread_struct_t *head;
+
+	do
+	{
+		head = kthread_runq->inbox;
+		u_elem->uthread_inbox_next = head;
+	} while(!__sync_bool_compare_and_swap(&(kthread_runq->inbox), head, u_elem));
+
+	/* Its kthread may be asleep with nothing else to do */
+	kthread_kick((kthread_context_t *)((char *)kthread_runq - offsetof(kthread_context_t, krunqueue)));
+	return;
+}
+
+extern int kthread_inbox_splice(kthread_runqueue_t *kthread_runq)
+{
+	uthread_head_t u_list;
+	uthread_struct_t *u_elem, *u_next;
+	int nelems = 0;
+
+	/* Nobody submitting : a read of a clean line */
+	if(!kthread_runq->inbox)
+		return 0;
+
+	/* Take the whole stack (safe against other takers); it is newest first */
+	TAILQ_INIT(&u_list);
+	u_elem = __sync_lock_test_and_set(&(kthread_runq->inbox), NULL);
+	for(; u_elem; u_elem = u_next)
+	{
+		u_next = u_elem->uthread_inbox_next;
+		TAILQ_INSERT_HEAD(&u_list, u_elem, uthread_runq);
+		nelems++;
+	}
+
+	add_list_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), &u_list);
+	return nelems;
+}
+
 #if 0
 static void print_runq_stats(runqueue_t *runq, char *runq_str)
 {
@@ -191,9 +252,8 @@ extern uthread_struct_t *sched_find_best_uthread(kthread_runqueue_t *kthread_run
 
 	runq = kthread_runq->active_runq;
 
-	kthread_runq->kthread_runqlock.holder = 0x04;
 
-    kthread_context_t *k_ctx = kthread_cpu_map[kthread_apic_id()];
+    kthread_context_t *k_ctx = kthread_current();
 
 	if(!(runq->uthread_mask))
 	{ /* No jobs in active. switch runqueue */
@@ -233,10 +293,45 @@ extern uthread_struct_t *sched_find_best_uthread(kthread_runqueue_t *kthread_run
 	return(u_obj);
 }
 
-uthread_struct_t *credit_find_best_uthread_single(kthread_runqueue_t *kthread_runq) {
+/* An accounting paid OVER uthreads back : move those out of debt up to
+ * UNDER, in every group. Once per accounting and runq. Caller holds the
+ * runq lock. */
+static void credit_resort_runqueue(kthread_runqueue_t *kthread_runq)
+{
+    runqueue_t *runq = kthread_runq->active_runq;
+    uthread_head_t *u_head;
+    uthread_struct_t *u_thread, *u_next;
+    unsigned int epoch = ksched_shared_info.credit_epoch;
+    unsigned int gmask, ugroup;
+
+    if (kthread_runq->credit_epoch == epoch)
+        return;
+    kthread_runq->credit_epoch = epoch;
+
+    for (gmask = runq->prio_array[UTHREAD_CREDIT_OVER].group_mask; gmask; gmask &= gmask - 1) {
+        ugroup = LOWEST_BIT_SET(gmask);
+        u_head = &runq->prio_array[UTHREAD_CREDIT_OVER].group[ugroup];
+        for (u_thread = TAILQ_FIRST(u_head); u_thread; u_thread = u_next) {
+            u_next = TAILQ_NEXT(u_thread, uthread_runq);
+            if (u_thread->uthread_credits < 0)
+                continue;
+
+            __rem_from_runqueue(runq, u_thread);
+            u_thread->uthread_priority = UTHREAD_CREDIT_UNDER;
+            __add_to_runqueue(runq, u_thread);
+        }
+    }
+}
+
+/* Takes the first uthread of the levels BOOST up to max_prio, lowest group
+ * first within a level (the accounting evens the groups out : one that
+ * ran ahead goes OVER). Caller holds the runq lock. */
+static uthread_struct_t *credit_find_best_uthread_single(kthread_runqueue_t *kthread_runq, unsigned int max_prio) {
     uthread_head_t *u_head;
     uthread_struct_t *u_thread;
     runqueue_t *runq;
+    kthread_context_t *k_ctx = kthread_current();
+    unsigned int pmask, gmask, uprio, ugroup;
 
     runq = kthread_runq->active_runq;
 
@@ -244,130 +339,202 @@ uthread_struct_t *credit_find_best_uthread_single(kthread_runqueue_t *kthread_ru
 		return NULL;
     }
 
-    // Take the first uthread on the active/expires queue, remove, and return it
-    u_head = &runq->prio_array[UTHREAD_CREDIT_UNDER].group[0];
-    u_thread = TAILQ_FIRST(u_head);
+    credit_resort_runqueue(kthread_runq);
 
-    // Check if head is valid before removal AND in runnable state
-    if (u_thread != NULL && (u_thread->uthread_state & (UTHREAD_INIT | UTHREAD_RUNNABLE))) {
-        __rem_from_runqueue(runq, u_thread);
-        return u_thread;
+    for (pmask = runq->uthread_mask & ((2U << max_prio) - 1); pmask; pmask &= pmask - 1) {
+        uprio = LOWEST_BIT_SET(pmask);
+
+        for (gmask = runq->prio_array[uprio].group_mask; gmask; gmask &= gmask - 1) {
+            ugroup = LOWEST_BIT_SET(gmask);
+            u_head = &runq->prio_array[uprio].group[ugroup];
+
+            // A requeued uthread is only ours to take once its context is
+            // saved : skip the one (at most) still on another kthread's cpu
+            TAILQ_FOREACH(u_thread, u_head, uthread_runq) {
+                if ((u_thread->uthread_state & (UTHREAD_INIT | UTHREAD_RUNNABLE)) &&
+                    (!u_thread->uthread_oncpu || u_thread->uthread_kctx == k_ctx)) {
+                    __rem_from_runqueue(runq, u_thread);
+                    return u_thread;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Looks for a uthread of the levels up to max_prio on the other kthreads */
+static uthread_struct_t *credit_migrate_uthread(kthread_context_t *k_ctx, unsigned int max_prio) {
+    kthread_context_t *temp_k_ctx;
+    gt_spinlock_t *temp_lock;
+    uthread_struct_t *u_thread;
+    unsigned int inx;
+
+    for (inx = 0; inx < kthread_nr; inx++) {
+        if (!(temp_k_ctx = kthread_cpu_map[inx]))
+            continue;
+
+        // Iterate over all OTHER kthreads
+        if (temp_k_ctx == k_ctx)
+            continue;
+
+        // Uthreads handed to a busy kthread are ours to take too
+        kthread_inbox_splice(&temp_k_ctx->krunqueue);
+
+        // If target has no uthreads, ignore
+        if (!temp_k_ctx->krunqueue.active_runq->uthread_tot)
+            continue;
+
+        // Acquire lock for target kthread
+        temp_lock = &temp_k_ctx->krunqueue.kthread_runqlock;
+        gt_spin_lock(temp_lock);
+        u_thread = credit_find_best_uthread_single(&temp_k_ctx->krunqueue, max_prio);
+        gt_spin_unlock(temp_lock);
+
+        if (u_thread) {
+            #if DEBUG
+            fprintf(stderr, "kthread(%d) migrated uthread(%d) from kthread(%d)!\n", k_ctx->cpuid,
+                    u_thread->uthread_tid, temp_k_ctx->cpuid);
+            #endif
+            return u_thread;
+        }
     }
 
     return NULL;
 }
 
 /**
- * Finds the highest priority uthread from current kthread's runqueue.
+ * Finds the best uthread for the current kthread : BOOST, then UNDER (ours,
+ * then any other kthread's), then OVER (ours, then any other kthread's).
  */
 extern uthread_struct_t *credit_find_best_uthread(kthread_runqueue_t *kthread_runq) {
-    uthread_head_t *u_head;
     uthread_struct_t *u_thread;
-    runqueue_t *runq;
     gt_spinlock_t *lock = &(kthread_runq->kthread_runqlock);
 
-    kthread_context_t *k_ctx = kthread_cpu_map[kthread_apic_id()];
+    kthread_context_t *k_ctx = kthread_current();
 
     // Look for a viable uthread in current runq
     gt_spin_lock(lock);
-    kthread_runq->kthread_runqlock.holder = 0x04;
-    u_thread = credit_find_best_uthread_single(kthread_runq);
+    u_thread = credit_find_best_uthread_single(kthread_runq, UTHREAD_CREDIT_UNDER);
     gt_spin_unlock(lock);
 
     if (u_thread != NULL)
         return u_thread;
 
     // No candidate? Time for uthread migration!
-    // At this point, NO UNDER UTHREADS LEFT IN EITHER QUEUE!
-    // Perform inter-kthread migration!
-    kthread_context_t *temp_k_ctx;
-    gt_spinlock_t *temp_lock;
-    int inx;
-
-    for (inx = 0; inx < GT_MAX_KTHREADS; inx++) {
-        if (!(temp_k_ctx = kthread_cpu_map[inx]))
-            break;
-
-        // Iterate over all OTHER kthreads
-        if (temp_k_ctx != k_ctx) {
-            // If target has no uthreads, ignore
-            if (!temp_k_ctx->krunqueue.active_runq->uthread_tot)
-                continue;
-
-            // Acquire lock for target kthread
-            temp_lock = &temp_k_ctx->krunqueue.kthread_runqlock;
-            gt_spin_lock(temp_lock);
-
-            // Look for an UNDER, RUNNABLE uthread on target kthread
-            if ((u_thread = credit_find_best_uthread_single(&temp_k_ctx->krunqueue))) {
-                // Found one!
-                #if DEBUG
-                fprintf(stderr, "kthread(%d) migrated uthread(%d) from kthread(%d)!\n", k_ctx->cpuid,
-                        u_thread->uthread_tid, temp_k_ctx->cpuid);
-                #endif
+    if ((u_thread = credit_migrate_uthread(k_ctx, UTHREAD_CREDIT_UNDER)))
+        return u_thread;
 
-                gt_spin_unlock(temp_lock);
+    // If no UNDER uthreads ANYWHERE, let's run one of our (or someone else's) OVER uthreads!
+    gt_spin_lock(lock);
+    u_thread = credit_find_best_uthread_single(kthread_runq, UTHREAD_CREDIT_OVER);
+    gt_spin_unlock(lock);
 
-                return u_thread;
-            }
+    if (u_thread != NULL)
+        return u_thread;
 
-            gt_spin_unlock(temp_lock);
-        }
-    }
+    // If this fails too, then NO UTHREADS ARE FOUND ANYWHERE!
+    return credit_migrate_uthread(k_ctx, UTHREAD_CREDIT_OVER);
+}
 
-    // If no UNDER uthreads ANYWHERE, let's run one of our (or someone else's) expired uthreads!
-    // First, try to find an OVER from one of our uthreads
-	// Switch runqueues!
-    runq = kthread_runq->active_runq;
-	kthread_runq->active_runq = kthread_runq->expires_runq;
-	kthread_runq->expires_runq = runq;
-	runq = kthread_runq->active_runq;
+/**********************************************************************/
+/* GT_SCHED_STEAL : no priorities or credits. Each kthread runs its own
+ * deque in FIFO order; an idle kthread steals half of another's. */
 
-    gt_spin_lock(lock);
-    u_head = &runq->prio_array[UTHREAD_CREDIT_UNDER].group[0];
-    u_thread = TAILQ_FIRST(u_head);
+/* Owner only (preemption disabled). The runq takes it if the deque can not grow. */
+extern void steal_add_uthread(kthread_runqueue_t *kthread_runq, uthread_struct_t *u_elem)
+{
+	if(gt_deque_push(&(kthread_runq->kthread_deque), u_elem))
+		add_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), u_elem);
+	return;
+}
 
-    // If found, return it!
-    if (u_thread != NULL) {
-        __rem_from_runqueue(runq, u_thread);
-        gt_spin_unlock(lock);
-        return u_thread;
-    }
+/* Oldest uthread of our own deque. One requeued by another kthread
+ * (then stolen) may not be switched out yet : it goes to the back. */
+static uthread_struct_t *steal_take_local(kthread_context_t *k_ctx, kthread_runqueue_t *kthread_runq)
+{
+	uthread_struct_t *u_obj;
+	long tries = gt_deque_size(&(kthread_runq->kthread_deque));
 
-    gt_spin_unlock(lock);
+	while((tries-- > 0) && (u_obj = gt_deque_steal(&(kthread_runq->kthread_deque))))
+	{
+		if(!u_obj->uthread_oncpu || (u_obj->uthread_kctx == k_ctx))
+			return u_obj;
+		steal_add_uthread(kthread_runq, u_obj);
+	}
 
-    // At this point, we need to look for a OVER uthread on some other kthread
-    for (inx = 0; inx < GT_MAX_KTHREADS; inx++) {
-        if (!(temp_k_ctx = kthread_cpu_map[inx]))
-            break;
+	return NULL;
+}
 
-        // Skip if kthread NULL, or same, or no uthreads
-        if (temp_k_ctx == k_ctx)
-            continue;
+extern uthread_struct_t *steal_find_best_uthread(kthread_runqueue_t *kthread_runq)
+{
+	kthread_context_t *k_ctx = kthread_current(), *victim;
+	uthread_struct_t *u_obj, *stolen[GT_DEQUE_STEAL_MAX];
+	runqueue_t *runq = kthread_runq->active_runq;
+	prio_struct_t *prioq;
+	unsigned int uprio, ugroup, seed;
+	int inx, jnx, start, nkthreads, nstolen;
 
-        // Check if kthread has uthreads available
-        runq = temp_k_ctx->krunqueue.expires_runq;
-        if (!runq->uthread_tot)
-            continue;
+	/* Handed in by others (wakeups, sleepers, io) : onto the deque,
+	 * behind what is there, where thieves can see them */
+	if(runq->uthread_tot)
+	{
+		gt_spin_lock(&(kthread_runq->kthread_runqlock));
+		while(runq->uthread_mask)
+		{
+			uprio = LOWEST_BIT_SET(runq->uthread_mask);
+			prioq = &(runq->prio_array[uprio]);
+			ugroup = LOWEST_BIT_SET(prioq->group_mask);
+			u_obj = TAILQ_FIRST(&(prioq->group[ugroup]));
+
+			if(gt_deque_push(&(kthread_runq->kthread_deque), u_obj))
+				break;
+			__rem_from_runqueue(runq, u_obj);
+		}
+		gt_spin_unlock(&(kthread_runq->kthread_runqlock));
+	}
 
-        // Acquire a lock for other kthread
-        temp_lock = &temp_k_ctx->krunqueue.kthread_runqlock;
-        gt_spin_lock(temp_lock);
+	if((u_obj = steal_take_local(k_ctx, kthread_runq)))
+	{
+		/* More than we can run : wake a sleeping thief */
+		if(ksched_shared_info.kthread_nidle && gt_deque_size(&(kthread_runq->kthread_deque)))
+			kthread_kick_idle(k_ctx);
+		return u_obj;
+	}
 
-        u_head = &runq->prio_array[UTHREAD_CREDIT_UNDER].group[0];
-        u_thread = TAILQ_FIRST(u_head);
+	/* Left behind when the deque could not grow */
+	if(runq->uthread_tot)
+		return sched_find_best_uthread(kthread_runq);
 
-        // If valid, remove it and return
-        if (u_thread != NULL) {
-            __rem_from_runqueue(runq, u_thread);
-            gt_spin_unlock(temp_lock);
-            return u_thread;
-        }
+	/* Idle : try every other kthread, starting at a random one */
+	nkthreads = kthread_nr;
+	seed = kthread_runq->steal_seed;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	kthread_runq->steal_seed = seed;
+	start = seed % nkthreads;
 
-        gt_spin_unlock(temp_lock);
-    }
+	for(inx = 0; inx < nkthreads; inx++)
+	{
+		victim = kthread_cpu_map[(start + inx) % nkthreads];
+		if(!victim || (victim == k_ctx) || !gt_deque_size(&(victim->krunqueue.kthread_deque)))
+			continue;
+
+		if(!(nstolen = gt_deque_steal_half(&(victim->krunqueue.kthread_deque),
+						(void **)stolen, GT_DEQUE_STEAL_MAX)))
+			continue;
+
+		#if DEBUG
+		fprintf(stderr, "kthread(%d) stole %d uthreads from kthread(%d)\n",
+				k_ctx->cpuid, nstolen, victim->cpuid);
+		#endif
+
+		for(jnx = 0; jnx < nstolen; jnx++)
+			steal_add_uthread(kthread_runq, stolen[jnx]);
+		return steal_take_local(k_ctx, kthread_runq);
+	}
 
-    // If we get here, then NO UTHREADS ARE FOUND ANYWHERE!
 	return NULL;
 }
 
@@ -57,29 +57,59 @@ typedef struct __kthread_runqueue
 	gt_spinlock_t kthread_runqlock;
 
 	uthread_struct_t *cur_uthread;	/* current running uthread (not in active/expires) */
-	unsigned int reserved0;
+	uthread_struct_t *prev_uthread; /* switched out, uthread_oncpu cleared on landing */
+	gt_spinlock_t *park_lock; /* released on landing (uthread_park) */
+	unsigned int credit_epoch; /* GT_SCHED_CREDIT : accounting the OVER level was re-sorted for */
 	uthread_head_t zombie_uthreads;
 
 	runqueue_t runqueues[2];
+
+	/* GT_SCHED_STEAL : uthreads pushed by this kthread (new, requeued,
+	 * woken here). Uthreads woken by others still come in through
+	 * active_runq; the owner moves them over. */
+	gt_deque_t kthread_deque;
+	unsigned int steal_seed; /* victim selection */
+	unsigned int reserved1;
+
+	/* Lock-free MPSC inbox : other kthreads (and gt_blocking helpers) push
+	 * the uthreads they create or wake here, instead of taking
+	 * kthread_runqlock. The owner splices it into active_runq at its next
+	 * scheduling point (or a credit thief does). Own cache line : only
+	 * read while nobody submits. */
+	uthread_struct_t * volatile inbox __attribute__((aligned(64)));
 } kthread_runqueue_t;
 
 /* only lock protected versions are exported */
 extern void init_runqueue(runqueue_t *runq);
 extern void add_to_runqueue(runqueue_t *runq, gt_spinlock_t *runq_lock, uthread_struct_t *u_elem);
 extern void rem_from_runqueue(runqueue_t *runq, gt_spinlock_t *runq_lock, uthread_struct_t *u_elem);
+/* Moves a whole list (linked through uthread_runq) in under one lock */
+extern void add_list_to_runqueue(runqueue_t *runq, gt_spinlock_t *runq_lock, uthread_head_t *u_list);
 extern void switch_runqueue(runqueue_t *from_runq, gt_spinlock_t *from_runqlock, 
 				runqueue_t *to_runq, gt_spinlock_t *to_runqlock, uthread_struct_t *u_elem);
 
 /* kthread runqueue */
 extern void kthread_init_runqueue(kthread_runqueue_t *kthread_runq);
 
+/* Any thread. Kicks the owner if it sleeps (kthread_idle). */
+extern void kthread_inbox_push(kthread_runqueue_t *kthread_runq, uthread_struct_t *u_elem);
+/* Moves the inbox into active_runq in push order, under one lock round
+ * trip. Returns the number moved. The owner does it at each scheduling
+ * point; a credit thief before looking at another kthread's runq. */
+extern int kthread_inbox_splice(kthread_runqueue_t *kthread_runq);
+
 /* Find the highest priority uthread.
  * Called by kthread handling VTALRM. */
 extern uthread_struct_t *credit_find_best_uthread(kthread_runqueue_t *kthread_runq);
 extern uthread_struct_t *sched_find_best_uthread(kthread_runqueue_t *kthread_runq);
+/* GT_SCHED_STEAL : own deque, else half of a random victim's deque */
+extern uthread_struct_t *steal_find_best_uthread(kthread_runqueue_t *kthread_runq);
+/* Onto the calling kthread's own deque (preemption disabled) */
+extern void steal_add_uthread(kthread_runqueue_t *kthread_runq, uthread_struct_t *u_elem);
 
 /* Find the highest priority uthread from uthread_group u_gid.
- * Called by kthread handling SIGUSR1(RELAYED signal).
+ * Meant for co-scheduling a group across kthreads (no caller : every
+ * kthread ticks on its own timer, nothing is relayed).
  * Also globally sets the penalty, if choosing a lower priority uthread. */
 extern uthread_struct_t *sched_find_best_uthread_group(kthread_runqueue_t *kthread_runq);
 
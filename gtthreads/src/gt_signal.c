@@ -3,6 +3,7 @@
 #include <linux/unistd.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sched.h>
 #include <signal.h>
@@ -12,6 +13,11 @@
 
 #include "gt_signal.h"
 
+/* glibc has no name for the tid member of sigevent */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 
 /**********************************************************************/
 /* kthread signal handling */
@@ -21,9 +27,13 @@ extern void kthread_install_sighandler(int signo, void (*handler)(int))
 	sigset_t set;
 	struct sigaction act;
 
-	/* Setup the handler */
+	/* Setup the handler.
+	 * SA_NODEFER : the scheduler switches uthreads from inside the handler
+	 * and the switch does not touch the signal mask. Re-entry is filtered by
+	 * the kthread preemption flag instead of the kernel blocking the signal. */
 	act.sa_handler = handler;
-	act.sa_flags = SA_RESTART;
+	act.sa_flags = SA_RESTART | SA_NODEFER;
+	sigemptyset(&act.sa_mask);
 	sigaction(signo, &act,0);
 
 	/* Unblock the signal */
@@ -58,15 +68,40 @@ extern void kthread_unblock_signal(int signo)
 	return;
 }
 
-extern int kthread_init_vtalrm_timeslice()
+/* Arms a timer on the cpu time of the calling kthread, delivering
+ * SIGVTALRM to that kthread only. Every kthread arms its own : the
+ * timeslice does not shrink with more kthreads and no tick is relayed.
+ * (kthreads are not in one thread group : the kernel only lets a
+ * kthread target itself.) Timeslices below the kernel tick go on the
+ * monotonic clock : kthread_idle disarms it before sleeping. */
+extern int kthread_init_vtalrm_timeslice(timer_t *timer, unsigned long nsec)
 {
-	struct itimerval timeslice;
+	struct sigevent sev;
+
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGVTALRM;
+	sev.sigev_value.sival_ptr = NULL;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
 
-	timeslice.it_interval.tv_sec = KTHREAD_VTALRM_SEC;
-	timeslice.it_interval.tv_usec = KTHREAD_VTALRM_USEC;
-	timeslice.it_value.tv_sec = KTHREAD_VTALRM_SEC;
-	timeslice.it_value.tv_usec = KTHREAD_VTALRM_USEC;
+	if(timer_create(KTHREAD_TIMESLICE_ON_CPUTIME(nsec) ? CLOCK_THREAD_CPUTIME_ID : CLOCK_MONOTONIC, &sev, timer))
+		return -1;
 
-	return setitimer(ITIMER_VIRTUAL,&timeslice,NULL);
+	if(kthread_set_vtalrm_timeslice(*timer, nsec))
+	{
+		timer_delete(*timer);
+		return -1;
+	}
+
+	return 0;
 }
 
+extern int kthread_set_vtalrm_timeslice(timer_t timer, unsigned long nsec)
+{
+	struct itimerspec timeslice;
+
+	timeslice.it_interval.tv_sec = nsec / 1000000000UL;
+	timeslice.it_interval.tv_nsec = nsec % 1000000000UL;
+	timeslice.it_value = timeslice.it_interval;
+
+	return timer_settime(timer, 0, &timeslice, NULL);
+}
@@ -1,14 +1,27 @@
 #ifndef __GT_SIGNAL_H
 #define __GT_SIGNAL_H
 
+#include <time.h>
+
 /**********************************************************************/
 /* kthread signal handling */
 extern void kthread_install_sighandler(int signo, void (*handler)(int));
 extern void kthread_block_signal(int signo);
 extern void kthread_unblock_signal(int signo);
 
-#define KTHREAD_VTALRM_SEC 0
-#define KTHREAD_VTALRM_USEC 100000
-extern int kthread_init_vtalrm_timeslice();
+#define KTHREAD_VTALRM_USEC 100000 /* default timeslice (gtthread_set_timeslice) */
+#define KTHREAD_TIMESLICE_MIN_USEC 50
+#define KTHREAD_TIMESLICE_MAX_USEC 1000000
+/* cpu time timers are only checked on the kernel tick : shorter
+ * timeslices run on the monotonic clock */
+#define KTHREAD_TIMESLICE_CPUTIME_USEC 10000
+#define KTHREAD_TIMESLICE_ON_CPUTIME(nsec) ((nsec) >= KTHREAD_TIMESLICE_CPUTIME_USEC * 1000UL)
+
+/* Per kthread timeslice (SIGVTALRM), on the clock KTHREAD_TIMESLICE_ON_CPUTIME
+ * picks for nsec. Delete with timer_delete. */
+extern int kthread_init_vtalrm_timeslice(timer_t *timer, unsigned long nsec);
+/* Re-arms it with another timeslice on the same clock (0 : disarms it).
+ * The calling kthread's timer only. */
+extern int kthread_set_vtalrm_timeslice(timer_t timer, unsigned long nsec);
 
 #endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* uthread_sleep_ns / uthread_sleep_until : sleepers on several kthreads,
+ * with durations filed in both wheel levels that matter, next to
+ * uthreads keeping the kthreads busy. No sleep may end early. A sleeper
+ * due behind a busy uthread waits up to a tick and a timeslice (of cpu
+ * time : longer on a shared cpu), so a late one is only a failure past
+ * a slack far above that. */
+
+#define SLEEP_TEST_KTHREADS 4
+#define SLEEP_TEST_ROUNDS 3
+#define SLEEP_TEST_SPINNERS 4
+#define SLEEP_TEST_SPIN_NS (400 * 1000000UL)
+#define SLEEP_TEST_SLACK_NS (250 * 1000000UL)
+#define SLEEP_TEST_TIMESLICE_USEC 10000
+
+static const unsigned long sleep_test_ns[] =
+{
+	0, 500000UL, 3000000UL, 40000000UL, 150000000UL, 300000000UL
+};
+#define SLEEP_TEST_SLEEPERS (sizeof(sleep_test_ns) / sizeof(sleep_test_ns[0]))
+
+static volatile unsigned long max_late;
+static volatile long sleeps;
+static volatile long failures;
+
+static void sleep_check(unsigned long start, unsigned long nsec, unsigned long end)
+{
+	unsigned long late, seen;
+
+	if(end < (start + nsec))
+	{
+		fprintf(stderr, "%lu ns sleep ended after %lu ns\n", nsec, end - start);
+		__sync_fetch_and_add(&failures, 1);
+		return;
+	}
+
+	late = end - (start + nsec);
+	if(late > SLEEP_TEST_SLACK_NS)
+	{
+		fprintf(stderr, "%lu ns sleep ended %lu ns late\n", nsec, late);
+		__sync_fetch_and_add(&failures, 1);
+	}
+	while(((seen = max_late) < late) && !__sync_bool_compare_and_swap(&max_late, seen, late))
+		;
+	__sync_fetch_and_add(&sleeps, 1);
+	return;
+}
+
+static int sleep_sleeper(void *arg)
+{
+	unsigned long nsec = sleep_test_ns[(long)arg], start;
+	int inx;
+
+	for(inx = 0; inx < SLEEP_TEST_ROUNDS; inx++)
+	{
+		start = gt_timer_now();
+		if(inx & 1)
+			uthread_sleep_until(start + nsec);
+		else
+			uthread_sleep_ns(nsec);
+		sleep_check(start, nsec, gt_timer_now());
+	}
+	return 0;
+}
+
+static int sleep_spinner(void *arg)
+{
+	unsigned long end = gt_timer_now() + SLEEP_TEST_SPIN_NS;
+
+	(void)arg;
+	/* Busy : the wheel is turned by the scheduler, not the idle loop */
+	while(gt_timer_now() < end)
+		;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	kthread_sched_t sched;
+	uthread_t u_tid;
+	unsigned long start;
+	long inx;
+
+	if(argc != 2)
+	{
+		printf("Usage: sleep_test [0=PRIORITY/1=CREDIT/2=STEAL]\n");
+		exit(0);
+	}
+
+	switch(strtol(argv[1], NULL, 10))
+	{
+		case 0: sched = GT_SCHED_PRIORITY; break;
+		case 2: sched = GT_SCHED_STEAL; break;
+		default: sched = GT_SCHED_CREDIT; break;
+	}
+
+	gtthread_set_kthreads(SLEEP_TEST_KTHREADS);
+	gtthread_set_timeslice(SLEEP_TEST_TIMESLICE_USEC);
+	gtthread_app_init(sched);
+
+	/* main blocks in the kernel */
+	start = gt_timer_now();
+	uthread_sleep_ns(sleep_test_ns[2]);
+	sleep_check(start, sleep_test_ns[2], gt_timer_now());
+
+	for(inx = 0; inx < (long)SLEEP_TEST_SLEEPERS; inx++)
+	{
+		uthread_create(&u_tid, sleep_sleeper, (void *)inx, 0, UTHREAD_DEFAULT_CREDITS);
+		uthread_detach(u_tid);
+	}
+	for(inx = 0; inx < SLEEP_TEST_SPINNERS; inx++)
+	{
+		uthread_create(&u_tid, sleep_spinner, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+		uthread_detach(u_tid);
+	}
+
+	gtthread_app_exit();
+
+	printf("sleeps %ld/%lu, max late %lu us, failures: %ld\n", sleeps,
+			(SLEEP_TEST_SLEEPERS * SLEEP_TEST_ROUNDS) + 1, max_late / 1000, failures);
+	return ((failures || (sleeps != (long)((SLEEP_TEST_SLEEPERS * SLEEP_TEST_ROUNDS) + 1))) ? 1 : 0);
+}
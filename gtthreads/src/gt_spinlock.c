@@ -1,61 +1,124 @@
+#include <stdio.h>
+#include <sched.h>
+
 #include "gt_spinlock.h"
 
 /* (http://www.intel.com/cd/ids/developer/asmo-na/eng/dc/threading/333935.htm)
- * With XCHG and CMPXCHG instructions, lock prefix is implicit when used with a 
+ * With XCHG and CMPXCHG instructions, lock prefix is implicit when used with a
  * memory operand.
  * Also, spin-locking can be made more efficient by spinning on volatile(dirty) read
  * rather than spinning on atomic instructions (as in the link above). */
 
-/* Locking has no effect on uniprocessor. */
-/* CANT EXECUTE A BUS LOCKING INSTRUCTION FROM USER MODE SO THIS IS 
- * THE BEST IMPLEMENTATION OF SPINLOCKS I COULD COME UP WITH
- * HAVE NO EFFECT ON A UNIPROCESSOR SYSTEM AS WE DONT NEED LOCKING THERE */
+/* Ticket lock : one locked xadd to take a ticket, then plain reads of
+ * owner till our turn. x86 keeps loads and stores in order (TSO) : the
+ * compiler barriers are all the fences acquire and release need. */
+#define GT_SPIN_BARRIER() __asm__ __volatile__ ("" : : : "memory")
+
+/* pause loops per waiter ahead of us */
+#define GT_SPIN_BACKOFF 32
+
+/* Backoff rounds before giving the cpu away on every round : with more
+ * kthreads than cpus, handing the lock over in order needs the holder
+ * and the next in line to actually run */
+#define GT_SPIN_YIELD_ROUNDS 16
+
+static inline unsigned long gt_spin_rdtsc(void)
+{
+	unsigned int lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long)hi << 32) | lo;
+}
 
 extern int gt_spinlock_init(gt_spinlock_t* spinlock)
 {
 	if(!spinlock)
 		return -1;
-	spinlock->locked = 0;
+	spinlock->next = 0;
+	spinlock->owner = 0;
+#if GT_SPINLOCK_STATS
+	spinlock->stats.acquired = 0;
+	spinlock->stats.contended = 0;
+	spinlock->stats.spin_cycles = 0;
+	spinlock->stats.holder = NULL;
+#endif
 	return 0;
 }
 
-/* spinlock function with backoff */
-void gt_actual_spinlock(volatile int * spinlock)
+/* Waits for our ticket, backing off in proportion to the waiters ahead
+ * (they each hold the lock for a while). Returns the cycles spent. */
+static unsigned long gt_actual_spinlock(gt_spinlock_t *spinlock, unsigned int ticket)
 {
-	int sp_val = 1;
- 
-	while(sp_val)
+	unsigned long start = gt_spin_rdtsc();
+	unsigned int ahead, inx, rounds = 0;
+
+	while((ahead = ticket - spinlock->owner))
 	{
-		__asm__ __volatile__ ("pause\n");
-		if(!*((volatile int *)spinlock))
-		{
-		__asm__ __volatile__ (
-			"movl $0x01, %%eax\n"
-			"xchg %%eax, (%1)\n"
-			"movl %%eax, %0\n"
-			:"=m"(sp_val) /* 0 */
-			: "r"(spinlock) /* 1 */
-			: "%eax"); /* No modified flags or clobbered registers */
-		}
+		for(inx = ahead * GT_SPIN_BACKOFF; inx; inx--)
+			__asm__ __volatile__ ("pause\n");
+
+		if(rounds < GT_SPIN_YIELD_ROUNDS)
+			rounds++;
+		else
+			sched_yield();
 	}
-	return;
+
+	return gt_spin_rdtsc() - start;
 }
 
 extern int gt_spin_lock(gt_spinlock_t* spinlock)
 {
+	unsigned int ticket;
+	unsigned long spun = 0;
+
 	if(!spinlock)
 		return -1;
-	gt_actual_spinlock(&(spinlock->locked));
-	return 0;	
+
+	ticket = __sync_fetch_and_add(&(spinlock->next), 1);
+	if(ticket != spinlock->owner)
+		spun = gt_actual_spinlock(spinlock, ticket);
+	GT_SPIN_BARRIER();
+
+#if GT_SPINLOCK_STATS
+	spinlock->stats.acquired++;
+	if(spun)
+		spinlock->stats.contended++;
+	spinlock->stats.spin_cycles += spun;
+	spinlock->stats.holder = __builtin_return_address(0);
+#else
+	(void)spun;
+#endif
+	return 0;
 }
 
 extern int gt_spin_unlock(gt_spinlock_t *spinlock)
 {
 	if(!spinlock)
 		return -1;
-	
-	if(spinlock->locked) 
-		spinlock->locked = 0;
-	   
+
+	/* Not held : leave it alone */
+	if(spinlock->owner == spinlock->next)
+		return -1;
+
+	/* Only the holder writes owner */
+	GT_SPIN_BARRIER();
+	spinlock->owner = spinlock->owner + 1;
 	return 0;
 }
+
+extern void gt_spinlock_stats_print(const char *name, gt_spinlock_t *spinlock)
+{
+#if GT_SPINLOCK_STATS
+	gt_spinlock_stats_t *stats = &(spinlock->stats);
+
+	fprintf(stderr, "%-20s acquired %10lu contended %10lu (%5.1f%%) spin cycles %14lu (%lu per wait) last holder %p\n",
+			name, stats->acquired, stats->contended,
+			stats->acquired ? (100.0 * stats->contended / stats->acquired) : 0.0,
+			stats->spin_cycles, stats->contended ? (stats->spin_cycles / stats->contended) : 0,
+			stats->holder);
+#else
+	(void)name;
+	(void)spinlock;
+#endif
+	return;
+}
@@ -1,10 +1,34 @@
 #ifndef __GT_SPINLOCK_H
 #define __GT_SPINLOCK_H
 
+/* Ticket lock : waiters get the lock in arrival order. Taking it is an
+ * acquire, releasing it a release (nothing leaks out of the section).
+ * A waiter that is switched out holds up every waiter behind it : on a
+ * kthread, take it with preemption disabled.
+ *
+ * Build with -DGT_SPINLOCK_STATS=1 to have the holder count acquisitions,
+ * contended acquisitions and cycles spent spinning, and to record its
+ * call site (see gt_spinlock_stats_print). */
+
+#ifndef GT_SPINLOCK_STATS
+#define GT_SPINLOCK_STATS 0
+#endif
+
+typedef struct __gt_spinlock_stats
+{
+	unsigned long acquired;
+	unsigned long contended; /* had to wait for a ticket */
+	unsigned long spin_cycles; /* tsc cycles spent waiting */
+	void *holder; /* call site of the last gt_spin_lock */
+} gt_spinlock_stats_t;
+
 typedef struct __gt_spinlock
 {
-	volatile int locked;
-	unsigned int holder;
+	volatile unsigned int next; /* next ticket to hand out */
+	volatile unsigned int owner; /* ticket being served */
+#if GT_SPINLOCK_STATS
+	gt_spinlock_stats_t stats; /* only written by the holder */
+#endif
 } gt_spinlock_t;
 
 
@@ -12,4 +36,13 @@ extern int gt_spinlock_init(gt_spinlock_t* spinlock);
 extern int gt_spin_lock(gt_spinlock_t* spinlock);
 extern int gt_spin_unlock(gt_spinlock_t *spinlock);
 
+/* One line on stderr (nothing without GT_SPINLOCK_STATS). */
+extern void gt_spinlock_stats_print(const char *name, gt_spinlock_t *spinlock);
+
+/* Unlocked snapshot */
+static inline int gt_spin_is_locked(gt_spinlock_t *spinlock)
+{
+	return (spinlock->next != spinlock->owner);
+}
+
 #endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_stack.h"
+
+/**********************************************************************/
+/* stack mappings */
+static gt_stack_t *gt_stack_map(gt_stack_cache_t *cache);
+static void gt_stack_unmap(gt_stack_t *stack);
+static void gt_stack_put(gt_stack_cache_t *cache, gt_stack_t *stack);
+
+/**********************************************************************/
+static gt_stack_t *gt_stack_map(gt_stack_cache_t *cache)
+{
+	gt_stack_t *stack;
+	unsigned long map_size;
+	char *map;
+
+	map_size = GT_STACK_GUARD_SIZE + cache->ssize;
+
+	map = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if(map == MAP_FAILED)
+		return NULL;
+
+	if(mprotect(map, GT_STACK_GUARD_SIZE, PROT_NONE))
+	{
+		munmap(map, map_size);
+		return NULL;
+	}
+
+	/* Header sits at the (16-byte aligned) top of the mapping */
+	stack = (gt_stack_t *)(((unsigned long)(map + map_size) - sizeof(gt_stack_t)) & ~0x0FUL);
+	stack->stack_base = map + GT_STACK_GUARD_SIZE;
+	stack->stack_size = (char *)stack - (char *)stack->stack_base;
+	stack->map_size = map_size;
+	stack->home = cache;
+	stack->next = NULL;
+	stack->resident = 1;
+
+	return stack;
+}
+
+static void gt_stack_unmap(gt_stack_t *stack)
+{
+	munmap((char *)stack->stack_base - GT_STACK_GUARD_SIZE, stack->map_size);
+	return;
+}
+
+/* Owner-side release into the free/idle lists */
+static void gt_stack_put(gt_stack_cache_t *cache, gt_stack_t *stack)
+{
+	unsigned long page_mask;
+
+	if(cache->nfree < GT_STACK_CACHE_HIWAT)
+	{
+		stack->next = cache->free_stacks;
+		cache->free_stacks = stack;
+		cache->nfree++;
+		return;
+	}
+
+	if(cache->nidle >= GT_STACK_CACHE_MAX)
+	{
+		gt_stack_unmap(stack);
+		return;
+	}
+
+	/* Above the high-water mark : give the pages back, keep the mapping.
+	 * The page holding the header stays resident. */
+	if(stack->resident)
+	{
+		page_mask = ~(GT_STACK_GUARD_SIZE - 1UL);
+		madvise(stack->stack_base,
+			((unsigned long)stack & page_mask) - (unsigned long)stack->stack_base,
+			MADV_DONTNEED);
+		stack->resident = 0;
+	}
+
+	stack->next = cache->idle_stacks;
+	cache->idle_stacks = stack;
+	cache->nidle++;
+	return;
+}
+
+/**********************************************************************/
+extern void gt_stack_cache_init(gt_stack_cache_t *cache, unsigned long ssize)
+{
+	cache->ssize = (ssize + GT_STACK_GUARD_SIZE - 1) & ~(GT_STACK_GUARD_SIZE - 1UL);
+	cache->free_stacks = NULL;
+	cache->nfree = 0;
+	cache->idle_stacks = NULL;
+	cache->nidle = 0;
+	cache->remote_free = NULL;
+	return;
+}
+
+extern gt_stack_t *gt_stack_alloc(gt_stack_cache_t *cache)
+{
+	gt_stack_t *stack, *next;
+
+	if(!cache->free_stacks && cache->remote_free)
+	{
+		/* Take over everything other kthreads returned */
+		stack = __sync_lock_test_and_set(&(cache->remote_free), NULL);
+		for(; stack; stack = next)
+		{
+			next = stack->next;
+			gt_stack_put(cache, stack);
+		}
+	}
+
+	if((stack = cache->free_stacks))
+	{
+		cache->free_stacks = stack->next;
+		cache->nfree--;
+	}
+	else if((stack = cache->idle_stacks))
+	{
+		/* Pages come back zero-filled on first touch */
+		cache->idle_stacks = stack->next;
+		cache->nidle--;
+		stack->resident = 1;
+	}
+	else if(!(stack = gt_stack_map(cache)))
+		return NULL;
+
+	stack->next = NULL;
+	return stack;
+}
+
+extern void gt_stack_free(gt_stack_cache_t *cache, gt_stack_t *stack)
+{
+	gt_stack_cache_t *home = stack->home;
+	gt_stack_t *head;
+
+	if(home == cache)
+	{
+		gt_stack_put(cache, stack);
+		return;
+	}
+
+	/* Remote free : lock-free push onto the home cache */
+	do
+	{
+		head = home->remote_free;
+		stack->next = head;
+	} while(!__sync_bool_compare_and_swap(&(home->remote_free), head, stack));
+
+	return;
+}
@@ -0,0 +1,53 @@
+#ifndef __GT_STACK_H
+#define __GT_STACK_H
+
+/**********************************************************************/
+/* uthread stacks : mmap'd with a PROT_NONE guard page at the low end
+ * (an overflow faults instead of corrupting the heap). Stacks of finished
+ * uthreads are cached per kthread and reused.
+ *
+ * Layout : [guard page][stack ............][gt_stack_t]
+ *          ^map        ^stack_base                     ^map + map_size */
+
+#define GT_STACK_GUARD_SIZE 4096
+#define GT_STACK_CACHE_HIWAT 64 /* idle stacks kept resident per kthread */
+#define GT_STACK_CACHE_MAX 1024 /* idle stacks kept mapped per kthread */
+
+struct __gt_stack_cache;
+
+typedef struct __gt_stack
+{
+	void *stack_base; /* lowest usable address */
+	unsigned long stack_size; /* usable bytes (up to this header) */
+	unsigned long map_size; /* whole mapping (guard + stack + header) */
+
+	struct __gt_stack_cache *home; /* cache of the kthread that mapped it */
+	struct __gt_stack *next; /* cache free list link */
+	unsigned int resident; /* 0 : pages released with MADV_DONTNEED */
+	unsigned int reserved;
+} gt_stack_t;
+
+/* NOTE: free/idle lists are touched only by the owner kthread (with
+ * preemption disabled). Other kthreads return stacks through remote_free,
+ * a lock-free LIFO which the owner takes over in one xchg. */
+typedef struct __gt_stack_cache
+{
+	unsigned long ssize; /* stack size handed out by this cache */
+
+	gt_stack_t *free_stacks; /* resident idle stacks (at most HIWAT) */
+	unsigned int nfree;
+	gt_stack_t *idle_stacks; /* released idle stacks (at most MAX) */
+	unsigned int nidle;
+
+	gt_stack_t * volatile remote_free; /* freed by other kthreads */
+} gt_stack_cache_t;
+
+extern void gt_stack_cache_init(gt_stack_cache_t *cache, unsigned long ssize);
+
+/* Called by the owner kthread of 'cache'. */
+extern gt_stack_t *gt_stack_alloc(gt_stack_cache_t *cache);
+
+/* Called by any kthread ('cache' is the caller's). Goes back to its home cache. */
+extern void gt_stack_free(gt_stack_cache_t *cache, gt_stack_t *stack);
+
+#endif
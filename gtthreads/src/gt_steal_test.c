@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* GT_SCHED_STEAL : one uthread spawns busy tasks, which all go on its
+ * own kthread's deque; the idle kthreads have to steal them. Every task
+ * has to run to completion exactly once (its exit status is joined), and
+ * some have to finish on another kthread. Exits 77 (skipped) when none
+ * was stolen. */
+
+#define STEAL_TEST_KTHREADS 4
+#define STEAL_TEST_TASKS 64
+#define STEAL_TEST_TASK_NS (2 * 1000000UL)
+#define STEAL_TEST_SKIP 77
+
+static volatile int spawner_cpu = -1;
+static volatile long tasks_run[STEAL_TEST_TASKS];
+static volatile long tasks_stolen;
+static volatile long tasks_joined;
+static volatile long failures;
+
+static int steal_task(void *arg)
+{
+	long inx = (long)arg;
+	unsigned long end = gt_timer_now() + STEAL_TEST_TASK_NS;
+
+	while(gt_timer_now() < end)
+		;
+
+	__sync_fetch_and_add(&tasks_run[inx], 1);
+	if((int)kthread_current()->cpuid != spawner_cpu)
+		__sync_fetch_and_add(&tasks_stolen, 1);
+	return (int)inx;
+}
+
+static int steal_spawner(void *arg)
+{
+	uthread_t u_tids[STEAL_TEST_TASKS];
+	void *u_status;
+	long inx;
+
+	(void)arg;
+	spawner_cpu = kthread_current()->cpuid;
+
+	for(inx = 0; inx < STEAL_TEST_TASKS; inx++)
+		uthread_create(&u_tids[inx], steal_task, (void *)inx, 0, UTHREAD_DEFAULT_CREDITS);
+
+	for(inx = 0; inx < STEAL_TEST_TASKS; inx++)
+	{
+		if(uthread_join(u_tids[inx], &u_status) || ((long)u_status != inx) || (tasks_run[inx] != 1))
+			__sync_fetch_and_add(&failures, 1);
+		else
+			__sync_fetch_and_add(&tasks_joined, 1);
+	}
+	return 0;
+}
+
+int main()
+{
+	uthread_t u_tid;
+
+	gtthread_set_kthreads(STEAL_TEST_KTHREADS);
+	gtthread_app_init(GT_SCHED_STEAL);
+
+	uthread_create(&u_tid, steal_spawner, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_detach(u_tid);
+
+	gtthread_app_exit();
+
+	printf("tasks joined %ld/%d, finished on another kthread %ld, failures: %ld\n", tasks_joined,
+			STEAL_TEST_TASKS, tasks_stolen, failures);
+	if(failures || (tasks_joined != STEAL_TEST_TASKS))
+		return 1;
+	return (tasks_stolen ? 0 : STEAL_TEST_SKIP);
+}
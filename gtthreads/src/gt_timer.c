@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gt_timer.h"
+
+/**********************************************************************/
+static void gt_timer_file(gt_timer_wheel_t *wheel, gt_timer_t *timer);
+static void gt_timer_cascade(gt_timer_wheel_t *wheel, int level, int inx);
+
+/**********************************************************************/
+/* Puts an armed timer in its slot relative to cur_tick */
+static void gt_timer_file(gt_timer_wheel_t *wheel, gt_timer_t *timer)
+{
+	unsigned long tick = timer->expires >> GT_TIMER_SHIFT;
+	unsigned long delta;
+	gt_timer_t **slot;
+	int level;
+
+	if(tick < wheel->cur_tick)
+		tick = wheel->cur_tick;
+	delta = tick - wheel->cur_tick;
+
+	for(level = 0; level < GT_TIMER_LEVELS - 1; level++)
+		if(delta < (1UL << ((level + 1) * GT_TIMER_LEVEL_BITS)))
+			break;
+
+	/* Beyond the last level : park in its farthest slot, filed again later */
+	if(delta >= (1UL << (GT_TIMER_LEVELS * GT_TIMER_LEVEL_BITS)))
+		tick = wheel->cur_tick + (1UL << (GT_TIMER_LEVELS * GT_TIMER_LEVEL_BITS)) - 1;
+
+	slot = &(wheel->slots[level][(tick >> (level * GT_TIMER_LEVEL_BITS)) & GT_TIMER_LEVEL_MASK]);
+	if((timer->next = *slot))
+		timer->next->pprev = &(timer->next);
+	*slot = timer;
+	timer->pprev = slot;
+	return;
+}
+
+/* Moves the timers of a higher level slot down */
+static void gt_timer_cascade(gt_timer_wheel_t *wheel, int level, int inx)
+{
+	gt_timer_t *timer, *next;
+
+	timer = wheel->slots[level][inx];
+	wheel->slots[level][inx] = NULL;
+
+	for(; timer; timer = next)
+	{
+		next = timer->next;
+		gt_timer_file(wheel, timer);
+	}
+	return;
+}
+
+/**********************************************************************/
+extern unsigned long gt_timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+extern unsigned long gt_timer_cputime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+extern void gt_timer_wheel_init(gt_timer_wheel_t *wheel)
+{
+	memset(wheel, 0, sizeof(gt_timer_wheel_t));
+	wheel->cur_tick = gt_timer_now() >> GT_TIMER_SHIFT;
+	return;
+}
+
+extern void gt_timer_add(gt_timer_wheel_t *wheel, gt_timer_t *timer)
+{
+	gt_timer_file(wheel, timer);
+	wheel->ntimers++;
+	return;
+}
+
+extern void gt_timer_del(gt_timer_wheel_t *wheel, gt_timer_t *timer)
+{
+	if(!timer->pprev)
+		return;
+
+	if((*(timer->pprev) = timer->next))
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+	timer->next = NULL;
+	wheel->ntimers--;
+	return;
+}
+
+extern unsigned long gt_timer_next(gt_timer_wheel_t *wheel)
+{
+	unsigned long tick = wheel->cur_tick;
+
+	if(!wheel->ntimers)
+		return ~0UL;
+
+	/* Up to the wrap : the slots past it may get earlier timers then */
+	do
+	{
+		if(wheel->slots[0][tick & GT_TIMER_LEVEL_MASK])
+			break;
+	} while(++tick & GT_TIMER_LEVEL_MASK);
+
+	return (tick + 1) << GT_TIMER_SHIFT;
+}
+
+extern gt_timer_t *gt_timer_expire(gt_timer_wheel_t *wheel, unsigned long now)
+{
+	unsigned long now_tick = now >> GT_TIMER_SHIFT;
+	gt_timer_t *expired = NULL, **expired_tail = &expired;
+	gt_timer_t *timer;
+	int level, inx;
+
+	while(wheel->cur_tick < now_tick)
+	{
+		/* Nothing armed : jump */
+		if(!wheel->ntimers)
+		{
+			wheel->cur_tick = now_tick;
+			break;
+		}
+
+		/* Level 0 wrapped : bring the next slot of each level down */
+		inx = wheel->cur_tick & GT_TIMER_LEVEL_MASK;
+		for(level = 1; !inx && (level < GT_TIMER_LEVELS); level++)
+		{
+			inx = (wheel->cur_tick >> (level * GT_TIMER_LEVEL_BITS)) & GT_TIMER_LEVEL_MASK;
+			gt_timer_cascade(wheel, level, inx);
+		}
+
+		inx = wheel->cur_tick & GT_TIMER_LEVEL_MASK;
+		while((timer = wheel->slots[0][inx]))
+		{
+			gt_timer_del(wheel, timer);
+
+			/* Re-cascaded from beyond the wheel range */
+			if((timer->expires >> GT_TIMER_SHIFT) > wheel->cur_tick)
+			{
+				gt_timer_add(wheel, timer);
+				continue;
+			}
+
+			*expired_tail = timer;
+			expired_tail = &(timer->next);
+		}
+
+		wheel->cur_tick++;
+	}
+
+	return expired;
+}
@@ -0,0 +1,51 @@
+#ifndef __GT_TIMER_H
+#define __GT_TIMER_H
+
+/**********************************************************************/
+/* Hierarchical timer wheel (one per kthread, touched only by its owner
+ * with preemption disabled).
+ * Time is CLOCK_MONOTONIC in ns; the wheel ticks every 2^GT_TIMER_SHIFT ns.
+ * Level 'l' has 64 slots of 64^l ticks each; a timer is filed in the
+ * coarsest level that can tell its tick apart and moves down (cascades)
+ * as the wheel turns. Timers fire at the end of their tick : never early,
+ * at most one tick late (plus however long the wheel is not advanced). */
+
+#define GT_TIMER_SHIFT 20 /* ~1ms ticks */
+#define GT_TIMER_LEVEL_BITS 6
+#define GT_TIMER_LEVEL_SLOTS (1 << GT_TIMER_LEVEL_BITS)
+#define GT_TIMER_LEVEL_MASK (GT_TIMER_LEVEL_SLOTS - 1)
+#define GT_TIMER_LEVELS 4 /* 2^24 ticks (~4.9 hours); farther timers re-cascade */
+
+typedef struct __gt_timer
+{
+	unsigned long expires; /* ns */
+	struct __gt_timer *next; /* slot list (or expired chain) */
+	struct __gt_timer **pprev; /* NULL when not armed */
+} gt_timer_t;
+
+typedef struct __gt_timer_wheel
+{
+	unsigned long cur_tick; /* ticks before this one are expired */
+	unsigned int ntimers; /* armed timers */
+	unsigned int reserved;
+	gt_timer_t *slots[GT_TIMER_LEVELS][GT_TIMER_LEVEL_SLOTS];
+} gt_timer_wheel_t;
+
+extern unsigned long gt_timer_now(void);
+/* cpu time (ns) of the calling kthread alone (CLOCK_THREAD_CPUTIME_ID) */
+extern unsigned long gt_timer_cputime(void);
+
+extern void gt_timer_wheel_init(gt_timer_wheel_t *wheel);
+extern void gt_timer_add(gt_timer_wheel_t *wheel, gt_timer_t *timer);
+extern void gt_timer_del(gt_timer_wheel_t *wheel, gt_timer_t *timer);
+
+/* When (ns) the wheel has to be turned next : the end of the first armed
+ * level 0 tick, or of the next level 0 wrap (timers cascade down then).
+ * Never later than the first expiry. ~0UL when nothing is armed. */
+extern unsigned long gt_timer_next(gt_timer_wheel_t *wheel);
+
+/* Turns the wheel up to 'now'. Returns the expired timers (disarmed),
+ * chained through 'next' in expiry order. */
+extern gt_timer_t *gt_timer_expire(gt_timer_wheel_t *wheel, unsigned long now);
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* gtthread_set_timeslice / _adaptive on one kthread : two spinners take
+ * turns only when preempted, so the window over their handoffs is the
+ * timeslice they got. A fixed slice set before gtthread_app_init, then
+ * another one at runtime (sub-ms : on the wall clock), have to show up
+ * within a factor of two. Adaptive, the slice has to shrink to its
+ * minimum while both spin, and grow back to its maximum once one is
+ * left alone. */
+
+#define TIMESLICE_TEST_FIRST_USEC 5000
+#define TIMESLICE_TEST_SECOND_USEC 20000
+#define TIMESLICE_TEST_SUBMS_USEC 500
+#define TIMESLICE_TEST_MIN_USEC 1000
+#define TIMESLICE_TEST_MAX_USEC 32000
+#define TIMESLICE_TEST_WINDOW_NS (300 * 1000000UL)
+
+typedef struct timeslice_phase
+{
+	unsigned long start; /* common to both spinners */
+	unsigned long window;
+	volatile int last; /* spinner that ran last */
+	volatile long handoffs;
+} timeslice_phase_t;
+
+static timeslice_phase_t *cur_phase;
+static volatile long failures;
+
+static int timeslice_spinner(void *arg)
+{
+	timeslice_phase_t *phase = cur_phase;
+	int self = (int)(long)arg;
+	unsigned long end = phase->start + phase->window;
+
+	while(gt_timer_now() < end)
+	{
+		if(phase->last != self)
+		{
+			phase->last = self;
+			phase->handoffs++;
+		}
+	}
+	return 0;
+}
+
+/* Mean slice (us) both spinners got over the window */
+static unsigned long timeslice_measure(unsigned long window)
+{
+	timeslice_phase_t phase;
+	uthread_t u_tids[2];
+	long inx;
+
+	memset(&phase, 0, sizeof(phase));
+	phase.last = -1;
+	phase.window = window;
+	phase.start = gt_timer_now();
+	cur_phase = &phase;
+	for(inx = 0; inx < 2; inx++)
+		uthread_create(&u_tids[inx], timeslice_spinner, (void *)inx, 0, UTHREAD_DEFAULT_CREDITS);
+	for(inx = 0; inx < 2; inx++)
+		uthread_join(u_tids[inx], NULL);
+
+	return (phase.handoffs ? (window / 1000 / phase.handoffs) : window / 1000);
+}
+
+static void timeslice_check(const char *what, unsigned long got, unsigned long want)
+{
+	int ok = ((got * 2 >= want) && (got <= want * 2));
+
+	printf("%s : %lu us (want %lu)%s\n", what, got, want, ok ? "" : " FAILED");
+	if(!ok)
+		__sync_fetch_and_add(&failures, 1);
+	return;
+}
+
+static int timeslice_alone(void *arg)
+{
+	unsigned long end = gt_timer_now() + (unsigned long)arg;
+
+	while(gt_timer_now() < end)
+		;
+	return 0;
+}
+
+static int timeslice_main(void *arg)
+{
+	uthread_t u_tid;
+
+	(void)arg;
+	timeslice_check("fixed, before init", timeslice_measure(TIMESLICE_TEST_WINDOW_NS),
+			TIMESLICE_TEST_FIRST_USEC);
+
+	gtthread_set_timeslice(TIMESLICE_TEST_SECOND_USEC);
+	timeslice_check("fixed, at runtime", timeslice_measure(TIMESLICE_TEST_WINDOW_NS),
+			TIMESLICE_TEST_SECOND_USEC);
+
+	gtthread_set_timeslice(TIMESLICE_TEST_SUBMS_USEC);
+	timeslice_check("fixed, sub-ms", timeslice_measure(TIMESLICE_TEST_WINDOW_NS),
+			TIMESLICE_TEST_SUBMS_USEC);
+
+	/* Lets it settle first */
+	gtthread_set_timeslice_adaptive(TIMESLICE_TEST_MIN_USEC, TIMESLICE_TEST_MAX_USEC);
+	timeslice_measure(TIMESLICE_TEST_WINDOW_NS / 3);
+	timeslice_check("adaptive, two spinning", timeslice_measure(TIMESLICE_TEST_WINDOW_NS),
+			TIMESLICE_TEST_MIN_USEC);
+
+	uthread_create(&u_tid, timeslice_alone, (void *)TIMESLICE_TEST_WINDOW_NS, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_join(u_tid, NULL);
+	timeslice_check("adaptive, one spinning", ksched_shared_info.kthread_timeslice_ns / 1000,
+			TIMESLICE_TEST_MAX_USEC);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	kthread_sched_t sched;
+	uthread_t u_tid;
+
+	if(argc != 2)
+	{
+		printf("Usage: timeslice_test [0=PRIORITY/1=CREDIT/2=STEAL]\n");
+		exit(0);
+	}
+
+	switch(strtol(argv[1], NULL, 10))
+	{
+		case 0: sched = GT_SCHED_PRIORITY; break;
+		case 2: sched = GT_SCHED_STEAL; break;
+		default: sched = GT_SCHED_CREDIT; break;
+	}
+
+	/* Out of range : refused */
+	if((gtthread_set_timeslice(KTHREAD_TIMESLICE_MIN_USEC - 1) != -1) ||
+		(gtthread_set_timeslice(KTHREAD_TIMESLICE_MAX_USEC + 1) != -1) ||
+		(gtthread_set_timeslice_adaptive(TIMESLICE_TEST_MAX_USEC, TIMESLICE_TEST_MIN_USEC) != -1))
+		__sync_fetch_and_add(&failures, 1);
+
+	gtthread_set_kthreads(1);
+	gtthread_set_timeslice(TIMESLICE_TEST_FIRST_USEC);
+	gtthread_app_init(sched);
+
+	uthread_create(&u_tid, timeslice_main, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_detach(u_tid);
+
+	gtthread_app_exit();
+
+	printf("failures: %ld\n", failures);
+	return (failures ? 1 : 0);
+}
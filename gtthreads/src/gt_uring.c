@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+#include <linux/io_uring.h>
+
+#include "gt_include.h"
+
+/**********************************************************************/
+static int gt_uring_setup(gt_uring_t *ring);
+static int gt_uring_submit(gt_uring_t *ring);
+static int gt_uring_io(int opcode, int fd, void *buf, size_t count, off_t offset);
+
+/**********************************************************************/
+static int gt_uring_setup(gt_uring_t *ring)
+{
+	struct io_uring_params params;
+	char *sq_map, *cq_map;
+
+	memset(&params, 0, sizeof(params));
+	if((ring->ring_fd = syscall(__NR_io_uring_setup, GT_URING_ENTRIES, &params)) < 0)
+		return -1;
+
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->ring_fd, IORING_OFF_SQ_RING);
+	if(sq_map == MAP_FAILED)
+		goto fail_close;
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_map = sq_map;
+	else if((cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto fail_sq;
+
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	ring->sq_map = sq_map;
+	ring->sq_head = (unsigned int *)(sq_map + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq_map + params.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(sq_map + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_array = (unsigned int *)(sq_map + params.sq_off.array);
+
+	ring->cq_map = cq_map;
+	ring->cq_head = (unsigned int *)(cq_map + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq_map + params.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(cq_map + params.cq_off.ring_mask);
+	ring->cq_entries = params.cq_entries;
+	ring->cqes = (struct io_uring_cqe *)(cq_map + params.cq_off.cqes);
+	return 0;
+
+fail_cq:
+	if(cq_map != sq_map)
+		munmap(cq_map, ring->cq_map_size);
+fail_sq:
+	munmap(sq_map, ring->sq_map_size);
+fail_close:
+	close(ring->ring_fd);
+	ring->ring_fd = -1;
+	return -1;
+}
+
+/* Hands the queued sqes to the kernel */
+static int gt_uring_submit(gt_uring_t *ring)
+{
+	int ret;
+
+	if(!ring->pending)
+		return 0;
+
+	while(((ret = syscall(__NR_io_uring_enter, ring->ring_fd, ring->pending, 0, 0, NULL, 0)) < 0) &&
+		(errno == EINTR))
+		;
+	if(ret < 0)
+		return -1;
+
+	ring->pending -= ret;
+	ring->inflight += ret;
+	return ret;
+}
+
+/* Queues one request and parks till it completes */
+static int gt_uring_io(int opcode, int fd, void *buf, size_t count, off_t offset)
+{
+	kthread_context_t *k_ctx;
+	gt_uring_t *ring;
+	struct io_uring_sqe *sqe;
+	gt_uring_req_t req;
+	unsigned int tail;
+
+	k_ctx = kthread_preempt_disable_current();
+	ring = &(k_ctx->kthread_uring);
+
+	/* Full rings : make room (or let the caller do it the blocking way) */
+	if((ring->pending + ring->inflight) >= ring->cq_entries)
+		goto busy;
+	tail = *(ring->sq_tail);
+	if((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= ring->sq_entries)
+	{
+		gt_uring_submit(ring);
+		if((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= ring->sq_entries)
+			goto busy;
+	}
+
+	req.u_obj = k_ctx->krunqueue.cur_uthread;
+	req.iov.iov_base = buf;
+	req.iov.iov_len = count;
+	req.res = 0;
+
+	sqe = &(ring->sqes[tail & ring->sq_mask]);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->off = offset;
+	if(opcode != IORING_OP_FSYNC)
+	{
+		sqe->addr = (unsigned long)&(req.iov);
+		sqe->len = 1;
+	}
+	sqe->user_data = (unsigned long)&req;
+
+	ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+
+	/* Submitted by the scheduler pass this park goes through */
+	uthread_park(NULL);
+
+	if(req.res < 0)
+	{
+		errno = -req.res;
+		return -1;
+	}
+	return req.res;
+
+busy:
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+	return -2;
+}
+
+/**********************************************************************/
+extern void gt_uring_init(gt_uring_t *ring)
+{
+	memset(ring, 0, sizeof(gt_uring_t));
+	if(gt_uring_setup(ring))
+	{
+	#if DEBUG
+		fprintf(stderr, "io_uring not available, uthread file I/O blocks\n");
+	#endif
+	}
+	return;
+}
+
+extern int gt_uring_poll(kthread_context_t *k_ctx)
+{
+	gt_uring_t *ring = &(k_ctx->kthread_uring);
+	kthread_runqueue_t *kthread_runq = &(k_ctx->krunqueue);
+	uthread_head_t u_list;
+	struct io_uring_cqe *cqe;
+	gt_uring_req_t *req;
+	unsigned int head, tail;
+	int nwoken = 0;
+
+	if(!ring->pending && !ring->inflight)
+		return 0;
+
+	gt_uring_submit(ring);
+
+	head = *(ring->cq_head);
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if(head == tail)
+		return 0;
+
+	TAILQ_INIT(&u_list);
+	for(; head != tail; head++)
+	{
+		cqe = &(ring->cqes[head & ring->cq_mask]);
+		req = (gt_uring_req_t *)(unsigned long)cqe->user_data;
+		req->res = cqe->res;
+		req->u_obj->uthread_state = UTHREAD_RUNNABLE;
+		uthread_credit_boost(req->u_obj);
+		TAILQ_INSERT_TAIL(&u_list, req->u_obj, uthread_runq);
+		nwoken++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	ring->inflight -= nwoken;
+
+	/* Submitters parked on this kthread */
+	add_list_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), &u_list);
+	return nwoken;
+}
+
+/**********************************************************************/
+/* Not a uthread, no ring, or full rings : the system call */
+#define GT_URING_USABLE(k_ctx) \
+	((k_ctx) && (k_ctx)->krunqueue.cur_uthread && ((k_ctx)->kthread_uring.ring_fd >= 0))
+
+extern ssize_t uthread_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	kthread_context_t *k_ctx = kthread_current();
+	ssize_t ret;
+
+	if(GT_URING_USABLE(k_ctx) && ((ret = gt_uring_io(IORING_OP_READV, fd, buf, count, offset)) != -2))
+		return ret;
+
+	return pread(fd, buf, count, offset);
+}
+
+extern ssize_t uthread_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	kthread_context_t *k_ctx = kthread_current();
+	ssize_t ret;
+
+	if(GT_URING_USABLE(k_ctx) && ((ret = gt_uring_io(IORING_OP_WRITEV, fd, (void *)buf, count, offset)) != -2))
+		return ret;
+
+	return pwrite(fd, buf, count, offset);
+}
+
+extern int uthread_fsync(int fd)
+{
+	kthread_context_t *k_ctx = kthread_current();
+	int ret;
+
+	if(GT_URING_USABLE(k_ctx) && ((ret = gt_uring_io(IORING_OP_FSYNC, fd, NULL, 0, 0)) != -2))
+		return ret;
+
+	return fsync(fd);
+}
@@ -0,0 +1,70 @@
+#ifndef __GT_URING_H
+#define __GT_URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**********************************************************************/
+/* uthread file I/O : one io_uring per kthread (raw syscalls, no liburing).
+ * A uthread queues its request in the kthread's submission ring and parks.
+ * Every pass through uthread_schedule (and the idle loop) submits what is
+ * queued in one io_uring_enter and reaps the completion ring (a shared
+ * memory read when nothing completed), requeueing the submitters in one go.
+ * Only the owner kthread touches its ring, with preemption disabled.
+ * Without io_uring (old kernel, seccomp) or from main, the calls block. */
+
+#define GT_URING_ENTRIES 256
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct __kthread_context;
+
+typedef struct __gt_uring
+{
+	int ring_fd; /* -1 : not available */
+	unsigned int pending; /* queued, not submitted yet */
+	unsigned int inflight; /* submitted, not reaped yet */
+
+	/* submission ring */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	/* completion ring */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	unsigned int cq_entries;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map;
+	unsigned long sq_map_size;
+	void *cq_map; /* == sq_map with IORING_FEAT_SINGLE_MMAP */
+	unsigned long cq_map_size;
+} gt_uring_t;
+
+/* A request lives on the stack of its parked submitter */
+typedef struct __gt_uring_req
+{
+	uthread_struct_t *u_obj;
+	struct iovec iov;
+	int res; /* cqe result (-errno on failure) */
+	int reserved;
+} gt_uring_req_t;
+
+extern void gt_uring_init(gt_uring_t *ring);
+
+/* Submits the queued requests and requeues the completed submitters.
+ * Caller has preemption disabled. Returns the number woken up. */
+extern int gt_uring_poll(struct __kthread_context *k_ctx);
+
+/**********************************************************************/
+/* uthread file I/O api(s) : same results/errno as the system calls */
+extern ssize_t uthread_pread(int fd, void *buf, size_t count, off_t offset);
+extern ssize_t uthread_pwrite(int fd, const void *buf, size_t count, off_t offset);
+extern int uthread_fsync(int fd);
+
+#endif
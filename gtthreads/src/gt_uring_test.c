@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "gt_include.h"
+
+/* uthread_pread / _pwrite / _fsync through one kthread's io_uring :
+ * writers fill a scratch file block by block, readers read every block
+ * back, a bad fd has to come back as -1/EBADF. Then reads on an empty
+ * pipe fill the ring : a file read made meanwhile has to take the
+ * blocking way (gt_uring_io's -2) and still read the right bytes. Exits
+ * 77 (skipped) without io_uring : only the blocking calls were tested. */
+
+#define URING_TEST_BLOCKS 64
+#define URING_TEST_BLOCK_SIZE 4096
+#define URING_TEST_SKIP 77
+
+#define URING_TEST_BYTE(block, inx) ((char)((block) * 31 + (inx)))
+
+static int file_fd;
+static int pipe_fds[2];
+
+static volatile long blocks_read;
+static volatile long fillers_done;
+static volatile int ring_full;
+static volatile int ring_available;
+static volatile long failures;
+
+static int uring_writer(void *arg)
+{
+	long block = (long)arg;
+	char buf[URING_TEST_BLOCK_SIZE];
+	int inx;
+
+	for(inx = 0; inx < URING_TEST_BLOCK_SIZE; inx++)
+		buf[inx] = URING_TEST_BYTE(block, inx);
+	if(uthread_pwrite(file_fd, buf, URING_TEST_BLOCK_SIZE, block * URING_TEST_BLOCK_SIZE) != URING_TEST_BLOCK_SIZE)
+		__sync_fetch_and_add(&failures, 1);
+	return 0;
+}
+
+static int uring_check_block(long block)
+{
+	char buf[URING_TEST_BLOCK_SIZE];
+	int inx;
+
+	if(uthread_pread(file_fd, buf, URING_TEST_BLOCK_SIZE, block * URING_TEST_BLOCK_SIZE) != URING_TEST_BLOCK_SIZE)
+		return -1;
+	for(inx = 0; inx < URING_TEST_BLOCK_SIZE; inx++)
+	{
+		if(buf[inx] != URING_TEST_BYTE(block, inx))
+			return -1;
+	}
+	return 0;
+}
+
+static int uring_reader(void *arg)
+{
+	if(uring_check_block((long)arg))
+		__sync_fetch_and_add(&failures, 1);
+	else
+		__sync_fetch_and_add(&blocks_read, 1);
+	return 0;
+}
+
+static int uring_filler(void *arg)
+{
+	char byte = 0;
+
+	(void)arg;
+	/* Parked in the ring till the pipe has data */
+	if((uthread_pread(pipe_fds[0], &byte, 1, 0) != 1) || (byte != 'f'))
+		__sync_fetch_and_add(&failures, 1);
+	else
+		__sync_fetch_and_add(&fillers_done, 1);
+	return 0;
+}
+
+static void uring_run(uthread_t *u_tids, long nr, int (*u_func)(void *))
+{
+	long inx;
+
+	for(inx = 0; inx < nr; inx++)
+		uthread_create(&u_tids[inx], u_func, (void *)inx, 0, UTHREAD_DEFAULT_CREDITS);
+	for(inx = 0; inx < nr; inx++)
+		uthread_join(u_tids[inx], NULL);
+	return;
+}
+
+static int uring_main(void *arg)
+{
+	gt_uring_t *ring = &(kthread_current()->kthread_uring);
+	uthread_t u_tids[URING_TEST_BLOCKS], *u_fillers;
+	unsigned int nfillers, inx;
+	char byte = 0, *bytes;
+
+	(void)arg;
+	ring_available = (ring->ring_fd >= 0);
+
+	uring_run(u_tids, URING_TEST_BLOCKS, uring_writer);
+	if(uthread_fsync(file_fd))
+		__sync_fetch_and_add(&failures, 1);
+	uring_run(u_tids, URING_TEST_BLOCKS, uring_reader);
+
+	errno = 0;
+	if((uthread_pread(-1, &byte, 1, 0) != -1) || (errno != EBADF))
+		__sync_fetch_and_add(&failures, 1);
+
+	if(!ring_available)
+		return 0;
+
+	/* As many requests as the completion ring holds */
+	nfillers = ring->cq_entries;
+	u_fillers = (uthread_t *)MALLOC_SAFE(nfillers * sizeof(uthread_t));
+	for(inx = 0; inx < nfillers; inx++)
+		uthread_create(&u_fillers[inx], uring_filler, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	for(inx = 0; (inx < 1000) && ((ring->pending + ring->inflight) < ring->cq_entries); inx++)
+		uthread_sleep_ns(1000000UL);
+
+	ring_full = ((ring->pending + ring->inflight) >= ring->cq_entries);
+	if(uring_check_block(URING_TEST_BLOCKS / 2))
+		__sync_fetch_and_add(&failures, 1);
+
+	bytes = (char *)MALLOC_SAFE(nfillers);
+	memset(bytes, 'f', nfillers);
+	if(write(pipe_fds[1], bytes, nfillers) != (ssize_t)nfillers)
+		__sync_fetch_and_add(&failures, 1);
+	for(inx = 0; inx < nfillers; inx++)
+		uthread_join(u_fillers[inx], NULL);
+	if(fillers_done != (long)nfillers)
+		__sync_fetch_and_add(&failures, 1);
+
+	FREE_SAFE(bytes);
+	FREE_SAFE(u_fillers);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char path[] = "/tmp/gt_uring_test.XXXXXX";
+	kthread_sched_t sched;
+	uthread_t u_tid;
+
+	if(argc != 2)
+	{
+		printf("Usage: uring_test [0=PRIORITY/1=CREDIT/2=STEAL]\n");
+		exit(0);
+	}
+
+	switch(strtol(argv[1], NULL, 10))
+	{
+		case 0: sched = GT_SCHED_PRIORITY; break;
+		case 2: sched = GT_SCHED_STEAL; break;
+		default: sched = GT_SCHED_CREDIT; break;
+	}
+
+	if(((file_fd = mkstemp(path)) < 0) || pipe(pipe_fds))
+	{
+		perror("mkstemp/pipe");
+		exit(1);
+	}
+	unlink(path);
+
+	/* One kthread : one ring for all of them */
+	gtthread_set_kthreads(1);
+	gtthread_app_init(sched);
+
+	uthread_create(&u_tid, uring_main, NULL, 0, UTHREAD_DEFAULT_CREDITS);
+	uthread_detach(u_tid);
+
+	gtthread_app_exit();
+
+	printf("io_uring %s, blocks read back %ld/%d, ring full %d, fillers %ld, failures: %ld\n",
+			ring_available ? "on" : "off", blocks_read, URING_TEST_BLOCKS, ring_full, fillers_done, failures);
+	if(failures || (blocks_read != URING_TEST_BLOCKS))
+		return 1;
+	if(!ring_available)
+		return URING_TEST_SKIP;
+	return (ring_full ? 0 : 1);
+}
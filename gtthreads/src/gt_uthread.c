@@ -9,6 +9,9 @@
 #include <setjmp.h>
 #include <errno.h>
 #include <assert.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
 
 #include "gt_include.h"
 /**********************************************************************/
@@ -24,101 +27,77 @@
 
 /**********************************************************************/
 /* uthread scheduling */
-static void uthread_context_func(int);
+static void uthread_context_func(void *);
 static int uthread_init(uthread_struct_t *u_new);
+static void uthread_reap_zombies(kthread_context_t *k_ctx);
+static int uthread_timers_run(kthread_context_t *k_ctx);
+static int uthread_credit_park(uthread_struct_t *u_obj);
 
 /**********************************************************************/
-/* uthread creation */
-#define UTHREAD_DEFAULT_SSIZE (32 * 1024)
-
-extern int uthread_create(uthread_t *u_tid, int (*u_func)(void *), void *u_arg, uthread_group_t u_gid, int credits);
+/* uthread struct cache */
+static uthread_struct_t *uthread_cache_alloc(uthread_cache_t *cache);
+static void uthread_cache_free(uthread_cache_t *cache, uthread_struct_t *u_obj);
 
 /**********************************************************************/
-/** DEFNITIONS **/
-/**********************************************************************/
+/* tid -> uthread struct (join/detach). Entries live from uthread_create
+ * till the struct is freed (DONE and joined/detached). */
+#define UTHREAD_TID_BUCKETS 1024 /* power of 2 */
 
-/**********************************************************************/
-/* uthread scheduling */
-
-/* Assumes that the caller has disabled vtalrm and sigusr1 signals */
-/* uthread_init will be using */
-static int uthread_init(uthread_struct_t *u_new)
+typedef struct __uthread_tid_bucket
 {
-	stack_t oldstack;
-	sigset_t set, oldset;
-	struct sigaction act, oldact;
-
-	gt_spin_lock(&(ksched_shared_info.uthread_init_lock));
+	gt_spinlock_t lock; /* taken with preemption disabled */
+	uthread_struct_t *head;
+} uthread_tid_bucket_t;
 
-	/* Register a signal(SIGUSR2) for alternate stack */
-	act.sa_handler = uthread_context_func;
-	act.sa_flags = (SA_ONSTACK | SA_RESTART);
-	if(sigaction(SIGUSR2,&act,&oldact))
-	{
-		fprintf(stderr, "uthread sigusr2 install failed !!\n");
-		return -1;
-	}
+static uthread_tid_bucket_t uthread_tid_table[UTHREAD_TID_BUCKETS];
 
-	/* Install alternate signal stack (for SIGUSR2) */
-	if(sigaltstack(&(u_new->uthread_stack), &oldstack))
-	{
-		fprintf(stderr, "uthread sigaltstack install failed.\n");
-		return -1;
-	}
-
-	/* Unblock the signal(SIGUSR2) */
-	sigemptyset(&set);
-	sigaddset(&set, SIGUSR2);
-	sigprocmask(SIG_UNBLOCK, &set, &oldset);
+#define UTHREAD_TID_BUCKET(tid) (&uthread_tid_table[(tid) & (UTHREAD_TID_BUCKETS - 1)])
 
-	/* SIGUSR2 handler expects kthread_runq->cur_uthread
-	 * to point to the newly created thread. We will temporarily
-	 * change cur_uthread, before entering the synchronous call
-	 * to SIGUSR2. */
+static uthread_struct_t *uthread_tid_lookup(uthread_tid_bucket_t *bucket, uthread_t u_tid);
+static void uthread_tid_remove(uthread_tid_bucket_t *bucket, uthread_struct_t *u_obj);
 
-	/* kthread_runq is made to point to this new thread
-	 * in the caller. Raise the signal(SIGUSR2) synchronously */
-#if 0
-	raise(SIGUSR2);
-#endif
-	syscall(__NR_tkill, kthread_cpu_map[kthread_apic_id()]->tid, SIGUSR2);
 
-	/* Block the signal(SIGUSR2) */
-	sigemptyset(&set);
-	sigaddset(&set, SIGUSR2);
-	sigprocmask(SIG_BLOCK, &set, &oldset);
-	if(sigaction(SIGUSR2,&oldact,NULL))
-	{
-		fprintf(stderr, "uthread sigusr2 revert failed !!\n");
-		return -1;
-	}
+/**********************************************************************/
+/** DEFNITIONS **/
+/**********************************************************************/
 
-	/* Disable the stack for signal(SIGUSR2) handling */
-	u_new->uthread_stack.ss_flags = SS_DISABLE;
+/**********************************************************************/
+/* uthread scheduling */
 
-	/* Restore the old stack/signal handling */
-	if(sigaltstack(&oldstack, NULL))
-	{
-		fprintf(stderr, "uthread sigaltstack revert failed.\n");
-		return -1;
-	}
+/* Builds the first frame of a new uthread directly on its stack.
+ * The first switch to it enters uthread_context_func via the trampoline.
+ * No signals, syscalls or global locks involved. */
+static int uthread_init(uthread_struct_t *u_new)
+{
+	gt_context_make(&(u_new->uthread_ctx), u_new->uthread_stack->stack_base,
+			u_new->uthread_stack->stack_size, uthread_context_func, u_new);
 
-	gt_spin_unlock(&(ksched_shared_info.uthread_init_lock));
+	u_new->uthread_state = UTHREAD_RUNNABLE;
+	u_new->runnable_time = gt_timer_now();
 	return 0;
 }
 
-extern void uthread_schedule(uthread_struct_t * (*kthread_best_sched_uthread)(kthread_runqueue_t *), int from_timer)
+extern void uthread_schedule(uthread_struct_t * (*kthread_best_sched_uthread)(kthread_runqueue_t *), int sched_reason)
 {
 	kthread_context_t *k_ctx;
 	kthread_runqueue_t *kthread_runq;
-	uthread_struct_t *u_obj;
+	uthread_struct_t *u_obj, *u_prev;
 
 	/* Signals used for cpu_thread scheduling */
 	// kthread_block_signal(SIGVTALRM);
-	// kthread_block_signal(SIGUSR1);
 
-	k_ctx = kthread_cpu_map[kthread_apic_id()];
+	k_ctx = kthread_current();
 	kthread_runq = &(k_ctx->krunqueue);
+	u_prev = NULL;
+
+	/* Scheduling signals are only recorded till we land in the next context.
+	 * A parking uthread already disabled preemption (uthread_park). */
+	if(sched_reason != UTHREAD_SCHED_BLOCK)
+		kthread_preempt_disable(k_ctx);
+
+	/* Reaping takes tid bucket locks : not while parking on one (uthread_join) */
+	if(!kthread_runq->park_lock)
+		uthread_reap_zombies(k_ctx);
 
     #if 0
     fprintf(stderr, "kthread(%d) has entered!\n", k_ctx->cpuid);
@@ -130,31 +109,25 @@ extern void uthread_schedule(uthread_struct_t * (*kthread_best_sched_uthread)(kt
 		kthread_runq->cur_uthread = NULL;
 
         // Deduct credits for the dude who already ran!
-        if (k_ctx->scheduler == GT_SCHED_CREDIT && (u_obj->uthread_state == UTHREAD_RUNNING)) {
-            /* If credit enabled, deduct credits based on current uthread run time. */
-			// Compute used time in nanoseconds
-			double used_time = (double)(clock() - u_obj->running_time) / (CLOCKS_PER_SEC / 1000000.0);
-            double credit_penalty = (used_time / KTHREAD_VTALRM_USEC) * UTHREAD_DEFAULT_CREDITS;
+        if (k_ctx->scheduler == GT_SCHED_CREDIT && (u_obj->uthread_state & (UTHREAD_RUNNING | UTHREAD_WAITING))) {
+			/* Charged in ns of this kthread's cpu clock. The accounting
+			 * (ksched_credit_account) pays them back in the same unit. */
+			unsigned long used_time = gt_timer_cputime() - u_obj->running_time;
+			long credits;
 
 			u_obj->used_time += used_time;
+			credits = __sync_sub_and_fetch(&(u_obj->uthread_credits), (long)used_time);
+			u_obj->uthread_credit_active = 1;
 
-			// Store used-time in the uarg
-			uthread_arg_t *u_arg = (uthread_arg_t *)u_obj->uthread_arg;
-			u_arg->used_time = u_obj->used_time;
-
-			u_obj->uthread_credits -= credit_penalty;
-
-            if (u_obj->uthread_credits < 0)
+			/* A boost lasts one dispatch */
+            if (credits < 0)
                 u_obj->uthread_priority = UTHREAD_CREDIT_OVER;
             else
                 u_obj->uthread_priority = UTHREAD_CREDIT_UNDER;
 
             #if DEBUG
-            fprintf(stderr, "Deducted %.3f credits from uthread(%d) -- used %.3f\n",
-                    credit_penalty,
-                    u_obj->uthread_tid, u_obj->used_time);
-            if (credit_penalty < 5)
-                fprintf(stderr, "\n");
+            fprintf(stderr, "Deducted %lu ns from uthread(%d) -- %ld ns left, used %lu ns\n",
+                    used_time, u_obj->uthread_tid, credits, u_obj->used_time);
             #endif
         }
 		
@@ -164,45 +137,66 @@ extern void uthread_schedule(uthread_struct_t * (*kthread_best_sched_uthread)(kt
 			 * cleanup/exit of uthread (core dump) */
 			uthread_head_t * kthread_zhead = &(kthread_runq->zombie_uthreads);
 			gt_spin_lock(&(kthread_runq->kthread_runqlock));
-			kthread_runq->kthread_runqlock.holder = 0x01;
 			TAILQ_INSERT_TAIL(kthread_zhead, u_obj, uthread_runq);
 			gt_spin_unlock(&(kthread_runq->kthread_runqlock));
 		
 			{
 				ksched_shared_info_t *ksched_info = &ksched_shared_info;
+				unsigned int cur_uthreads;
+
+				/* Out of the credit accounting */
+				if(u_obj->uthread_credit_flags & UTHREAD_CREDIT_LISTED)
+				{
+					gt_spin_lock(&(ksched_info->credit_lock));
+					TAILQ_REMOVE(&(ksched_info->credit_uthreads), u_obj, uthread_credit_link);
+					u_obj->uthread_credit_flags &= ~UTHREAD_CREDIT_LISTED;
+					gt_spin_unlock(&(ksched_info->credit_lock));
+				}
+
 				gt_spin_lock(&ksched_info->ksched_lock);
-				ksched_info->kthread_cur_uthreads--;
+				cur_uthreads = --ksched_info->kthread_cur_uthreads;
 				gt_spin_unlock(&ksched_info->ksched_lock);
+
+				/* Sleeping kthreads have to see the end */
+				if(!cur_uthreads)
+					kthread_kick_all();
 			}
 
             // If DONE AND did not come from timer event, jump to back to kthread wait state
 //            if (ksched_shared_info.scheduler == GT_SCHED_CREDIT && !from_timer) {
 //                /* Re-install the scheduling signal handlers */
 //                kthread_install_sighandler(SIGVTALRM, k_ctx->kthread_sched_timer);
-//                kthread_install_sighandler(SIGUSR1, k_ctx->kthread_sched_relay);
 //
-//                siglongjmp(k_ctx->kthread_env, 1);
+//                gt_context_restore(&(k_ctx->kthread_ctx));
 //            }
 		}
+		else if (u_obj->uthread_state == UTHREAD_WAITING)
+		{
+			/* Parked : not requeued, uthread_wakeup does it */
+			u_prev = u_obj;
+		}
+		else if ((k_ctx->scheduler == GT_SCHED_CREDIT) && u_obj->uthread_cap &&
+				(u_obj->uthread_priority == UTHREAD_CREDIT_OVER) && uthread_credit_park(u_obj))
+		{
+			/* Capped and over : out of every runq till the accounting
+			 * pays its debt back */
+			u_prev = u_obj;
+		}
 		else
 		{
 			/* XXX: Apply uthread_group_penalty before insertion */
 			u_obj->uthread_state = UTHREAD_RUNNABLE;
 
-            // If over credits, add to expired/over runqueue
-            // Otherwise, put it back at the *tail* of the active runqueue
+            // CREDIT : one active runq, BOOST/UNDER/OVER are its levels.
+            // Put it back at the *tail* of its level.
             if (ksched_shared_info.scheduler == GT_SCHED_CREDIT) {
-                if (u_obj->uthread_priority == UTHREAD_CREDIT_OVER) {
-					// Refresh credits before inserting into OVER queue
-					u_obj->uthread_priority = UTHREAD_CREDIT_UNDER;
-					u_obj->uthread_credits = u_obj->uthread_original_credits;
-
-					add_to_runqueue(kthread_runq->expires_runq, &(kthread_runq->kthread_runqlock), u_obj);
-				}
-
-				else {
-					add_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), u_obj);
-				}
+                add_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), u_obj);
+            } else if (ksched_shared_info.scheduler == GT_SCHED_STEAL) {
+                // Local deque : behind the ones already there
+                steal_add_uthread(kthread_runq, u_obj);
+            } else if (sched_reason == UTHREAD_SCHED_YIELD) {
+                // Voluntary yield: tail of its level, still in this round
+                add_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), u_obj);
             } else {
                 // For priority: just expire!
                 add_to_runqueue(kthread_runq->expires_runq, &(kthread_runq->kthread_runqlock), u_obj);
@@ -212,9 +206,9 @@ extern void uthread_schedule(uthread_struct_t * (*kthread_best_sched_uthread)(kt
             fprintf(stderr, "Returning uthread(%d) to queue\n", u_obj->uthread_tid);
             #endif
 
-			/* XXX: Save the context (signal mask not saved) */
-			if(sigsetjmp(u_obj->uthread_env, 0))
-				return;
+			/* Context is saved when switching to the next uthread.
+			 * Other kthreads leave it alone till then (uthread_oncpu). */
+			u_prev = u_obj;
 		}
 	}
 
@@ -228,7 +222,7 @@ extern void uthread_schedule(uthread_struct_t * (*kthread_best_sched_uthread)(kt
 //                k_ctx->kthread_flags |= KTHREAD_DONE;
 //            }
 //
-//            siglongjmp(k_ctx->kthread_env, 1);
+//            gt_context_restore(&(k_ctx->kthread_ctx));
 //            return;
 //        }
 //    } else {
@@ -236,12 +230,33 @@ extern void uthread_schedule(uthread_struct_t * (*kthread_best_sched_uthread)(kt
 //        // PASS
 //    }
 
+	/* Requeue due sleepers, uthreads submitted by other kthreads and
+	 * ready io waiters, submit queued file I/O
+	 * and reap its completions. Not before the current uthread is dealt
+	 * with : it may be one of them. */
+	ksched_timeslice_update(k_ctx);
+	if(k_ctx->scheduler == GT_SCHED_CREDIT)
+		ksched_credit_account();
+	uthread_timers_run(k_ctx);
+	kthread_inbox_splice(kthread_runq);
+	gt_io_poll(k_ctx, kthread_runq->park_lock);
+	gt_uring_poll(k_ctx);
+
 	if (!(u_obj = kthread_best_sched_uthread(kthread_runq))) {
-		if (ksched_shared_info.kthread_tot_uthreads && k_ctx->cpuid == 0) {
+		/* Parked uthreads are not in any runq : kthread(0) is done only
+		 * when no uthread is left at all */
+		if (ksched_shared_info.kthread_tot_uthreads && !ksched_shared_info.kthread_cur_uthreads
+				&& k_ctx->cpuid == 0) {
 			k_ctx->kthread_flags |= KTHREAD_DONE;
 		}
 
-		siglongjmp(k_ctx->kthread_env, 1);
+		/* A requeued uthread must still be resumable from the runq */
+		kthread_runq->prev_uthread = u_prev;
+		if(!u_prev)
+			gt_context_restore(&(k_ctx->kthread_ctx));
+
+		gt_context_switch(&(u_prev->uthread_ctx), &(k_ctx->kthread_ctx));
+		uthread_switch_finish();
 		return;
 	}
 
@@ -259,72 +274,538 @@ extern void uthread_schedule(uthread_struct_t * (*kthread_best_sched_uthread)(kt
 	}
 
 	u_obj->uthread_state = UTHREAD_RUNNING;
-    u_obj->running_time = clock();
-	
-	/* Re-install the scheduling signal handlers */
-	kthread_install_sighandler(SIGVTALRM, k_ctx->kthread_sched_timer);
-	kthread_install_sighandler(SIGUSR1, k_ctx->kthread_sched_relay);
+	u_obj->uthread_oncpu = 1;
+	u_obj->last_cpu_id = u_obj->cpu_id;
+	u_obj->cpu_id = k_ctx->cpuid;
+	u_obj->uthread_kctx = k_ctx;
+    u_obj->running_time = gt_timer_cputime();
+
+	/* This dispatch serves any tick recorded while scheduling */
+	k_ctx->kthread_preempt_pending = 0;
+	k_ctx->kthread_idle_since = 0;
+
+	/* Picked the uthread we were running : no switch */
+	if(u_obj == u_prev)
+	{
+		uthread_switch_finish();
+		return;
+	}
 
-	/* Jump to the selected uthread context */
-	siglongjmp(u_obj->uthread_env, 1);
+	/* Switch to the selected uthread context. Save the outgoing one
+	 * (if any); we return here when it is scheduled again. */
+	kthread_runq->prev_uthread = u_prev;
+	if(!u_prev)
+		gt_context_restore(&(u_obj->uthread_ctx));
 
+	gt_context_switch(&(u_prev->uthread_ctx), &(u_obj->uthread_ctx));
+	uthread_switch_finish();
 	return;
 }
 
+/* A DONE uthread is still on its stack while it is being switched out.
+ * It is reaped by the next uthread_schedule on the same kthread : the stack
+ * goes back to the stack cache. The struct goes to its home uthread cache
+ * if the uthread is detached or joined, else the joiner frees it. */
+static void uthread_reap_zombies(kthread_context_t *k_ctx)
+{
+	kthread_runqueue_t *kthread_runq = &(k_ctx->krunqueue);
+	uthread_head_t *kthread_zhead = &(kthread_runq->zombie_uthreads);
+	uthread_tid_bucket_t *bucket;
+	uthread_struct_t *u_obj;
+	int do_free;
 
-/* For uthreads, we obtain a seperate stack by registering an alternate
- * stack for SIGUSR2 signal. Once the context is saved, we turn this 
- * into a regular stack for uthread (by using SS_DISABLE). */
-static void uthread_context_func(int signo)
+	while(!TAILQ_EMPTY(kthread_zhead))
+	{
+		gt_spin_lock(&(kthread_runq->kthread_runqlock));
+		u_obj = TAILQ_FIRST(kthread_zhead);
+		TAILQ_REMOVE(kthread_zhead, u_obj, uthread_runq);
+		gt_spin_unlock(&(kthread_runq->kthread_runqlock));
+
+		gt_stack_free(&(k_ctx->kthread_stacks), u_obj->uthread_stack);
+		u_obj->uthread_stack = NULL;
+
+		bucket = UTHREAD_TID_BUCKET(u_obj->uthread_tid);
+		gt_spin_lock(&(bucket->lock));
+		u_obj->uthread_flags |= UTHREAD_REAPED;
+		if((do_free = (u_obj->uthread_flags & (UTHREAD_DETACHED | UTHREAD_JOINED))))
+			uthread_tid_remove(bucket, u_obj);
+		gt_spin_unlock(&(bucket->lock));
+
+		if(do_free)
+			uthread_cache_free(&(k_ctx->kthread_uthreads), u_obj);
+	}
+
+	return;
+}
+
+/* Called on landing in a context (resumed or new uthread, or the kthread
+ * loop). The outgoing uthread's context is saved by now : other kthreads
+ * may run it, and a waker may see it. We may have migrated, so look up
+ * the kthread again. */
+extern void uthread_switch_finish(void)
 {
-	uthread_struct_t *cur_uthread;
-	kthread_runqueue_t *kthread_runq;
+	kthread_context_t *k_ctx = kthread_current();
+	kthread_runqueue_t *kthread_runq = &(k_ctx->krunqueue);
+	uthread_struct_t *u_prev;
+	gt_spinlock_t *park_lock;
 
-    kthread_context_t *k_ctx = kthread_cpu_map[kthread_apic_id()];
-	kthread_runq = &(k_ctx->krunqueue);
+	if((u_prev = kthread_runq->prev_uthread))
+	{
+		kthread_runq->prev_uthread = NULL;
+		__asm__ __volatile__ ("" : : : "memory");
+		u_prev->uthread_oncpu = 0;
+	}
 
-    #if 0
-    fprintf(stderr, "..... uthread_context_func (STATE=%d, T=%d) .....\n",
-            kthread_runq->cur_uthread->uthread_state,
-            (int)clock());
-    #endif
-	
-	/* kthread->cur_uthread points to newly created uthread */
-	if(!sigsetjmp(kthread_runq->cur_uthread->uthread_env,0))
+	if((park_lock = kthread_runq->park_lock))
 	{
-		/* In UTHREAD_INIT : saves the context and returns.
-		 * Otherwise, continues execution. */
-		/* DONT USE any locks here !! */
-		assert(kthread_runq->cur_uthread->uthread_state == UTHREAD_INIT);
-		kthread_runq->cur_uthread->uthread_state = UTHREAD_RUNNABLE;
-        kthread_runq->cur_uthread->runnable_time = clock();
-        #if 0
-        fprintf(stderr, "..... uthread_context_func (STATE=%d, T=%d) .....\n",
-                kthread_runq->cur_uthread->uthread_state,
-                (int)clock());
-        #endif
-		return;
+		kthread_runq->park_lock = NULL;
+		gt_spin_unlock(park_lock);
 	}
 
-	/* UTHREAD_RUNNING : siglongjmp was executed. */
-	cur_uthread = kthread_runq->cur_uthread;
+	/* A tick arrived while switching */
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+}
+
+/* uthread_schedule with the scheduler in use */
+extern void uthread_reschedule(int sched_reason)
+{
+    if (ksched_shared_info.scheduler == GT_SCHED_PRIORITY)
+        uthread_schedule(&sched_find_best_uthread, sched_reason);
+    else if (ksched_shared_info.scheduler == GT_SCHED_STEAL)
+        uthread_schedule(&steal_find_best_uthread, sched_reason);
+    else
+        uthread_schedule(&credit_find_best_uthread, sched_reason);
+}
+
+/* Serves a tick that was recorded while preemption was off */
+extern void uthread_preempt_resched(void)
+{
+	uthread_reschedule(UTHREAD_SCHED_TIMER);
+}
+
+
+/* Entry point of every uthread (on its own stack, see uthread_init).
+ * Reached through the first switch, with the kthread in UTHREAD_RUNNING. */
+static void uthread_context_func(void *arg)
+{
+	uthread_struct_t *cur_uthread = (uthread_struct_t *)arg;
+	uthread_tid_bucket_t *bucket;
+	kthread_context_t *k_ctx;
+
 	assert(cur_uthread->uthread_state == UTHREAD_RUNNING);
 
-    #if 0
-        fprintf(stderr, "..... uthread_context_func (STATE=%d, T=%d) .....\n",
-                kthread_runq->cur_uthread->uthread_state,
-                (int)clock());
-    #endif
+	uthread_switch_finish();
 
     /* Execute the uthread task */
-	cur_uthread->uthread_func(cur_uthread->uthread_arg);
+	cur_uthread->exit_status = (void *)(long)cur_uthread->uthread_func(cur_uthread->uthread_arg);
+    cur_uthread->done_time = gt_timer_now();
+
+	/* DONE and the joiner are checked together (uthread_join) */
+	k_ctx = kthread_preempt_disable_current();
+	bucket = UTHREAD_TID_BUCKET(cur_uthread->uthread_tid);
+	gt_spin_lock(&(bucket->lock));
 	cur_uthread->uthread_state = UTHREAD_DONE;
-    cur_uthread->done_time = clock();
+	if(cur_uthread->uthread_joiner)
+		uthread_wakeup(cur_uthread->uthread_joiner);
+	gt_spin_unlock(&(bucket->lock));
 
-    if (ksched_shared_info.scheduler == GT_SCHED_PRIORITY)
-        uthread_schedule(&sched_find_best_uthread, 0);
-    else
-        uthread_schedule(&credit_find_best_uthread, 0);
+	/* A pending tick schedules us out as DONE right here */
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+
+	uthread_reschedule(UTHREAD_SCHED_EXIT);
+}
+
+extern void uthread_yield(void)
+{
+	kthread_context_t *k_ctx = kthread_current();
+
+	/* Not in a uthread (eg. main before gtthread_app_exit) */
+	if(!k_ctx || !k_ctx->krunqueue.cur_uthread)
+		return;
+
+	uthread_reschedule(UTHREAD_SCHED_YIELD);
+}
+
+/**********************************************************************/
+/* Blocking (see gt_uthread.h) */
+
+extern void uthread_park(gt_spinlock_t *lock)
+{
+	kthread_context_t *k_ctx = kthread_current();
+
+	k_ctx->krunqueue.cur_uthread->uthread_state = UTHREAD_WAITING;
+	k_ctx->krunqueue.park_lock = lock;
+
+	uthread_reschedule(UTHREAD_SCHED_BLOCK);
+}
+
+extern void uthread_wakeup(uthread_struct_t *u_obj)
+{
+	kthread_runqueue_t *kthread_runq = &(u_obj->uthread_kctx->krunqueue);
+	kthread_context_t *k_ctx;
+
+	u_obj->uthread_state = UTHREAD_RUNNABLE;
+	uthread_credit_boost(u_obj);
+
+	/* GT_SCHED_STEAL : onto the waker's own deque (no remote lock; the
+	 * pair it talks to runs here). gt_blocking helpers are no kthread. */
+	if((ksched_shared_info.scheduler == GT_SCHED_STEAL) && (k_ctx = kthread_current()))
+	{
+		steal_add_uthread(&(k_ctx->krunqueue), u_obj);
+		return;
+	}
+
+	/* Parked on another kthread : through its inbox */
+	if(kthread_current() != u_obj->uthread_kctx)
+	{
+		kthread_inbox_push(kthread_runq, u_obj);
+		return;
+	}
+
+	add_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), u_obj);
+}
+
+extern void uthread_credit_boost(uthread_struct_t *u_obj)
+{
+	if(ksched_shared_info.scheduler != GT_SCHED_CREDIT)
+		return;
+
+	u_obj->uthread_priority = (u_obj->uthread_credits < 0) ? UTHREAD_CREDIT_OVER : UTHREAD_CREDIT_BOOST;
+}
+
+/* Takes a capped OVER uthread being switched out off the runqs. The
+ * accounting pays credits under credit_lock : checked again under it.
+ * Returns 0 if it got paid meanwhile (requeue it). */
+static int uthread_credit_park(uthread_struct_t *u_obj)
+{
+	ksched_shared_info_t *ksched_info = &ksched_shared_info;
+	int parked = 0;
+
+	gt_spin_lock(&(ksched_info->credit_lock));
+	if(u_obj->uthread_credits < 0)
+	{
+		u_obj->uthread_credit_flags |= UTHREAD_CREDIT_PARKED;
+		ksched_info->credit_nparked++;
+		u_obj->uthread_state = UTHREAD_WAITING;
+		parked = 1;
+	}
+	gt_spin_unlock(&(ksched_info->credit_lock));
+
+	#if DEBUG
+	if(parked)
+		fprintf(stderr, "uthread(%d) capped at %u%% : parked till the next accounting\n",
+				u_obj->uthread_tid, u_obj->uthread_cap);
+	#endif
+	return parked;
+}
+
+/**********************************************************************/
+/* sleep */
+
+/* Requeues the expired sleepers on this kthread's active runq in one go.
+ * Caller has preemption disabled (the wheel is only touched by its kthread). */
+static int uthread_timers_run(kthread_context_t *k_ctx)
+{
+	kthread_runqueue_t *kthread_runq = &(k_ctx->krunqueue);
+	uthread_head_t u_list;
+	uthread_struct_t *u_obj;
+	gt_timer_t *timer, *next;
+	int nwoken = 0;
+
+	/* No sleepers : not even a clock read */
+	if(!k_ctx->kthread_timers.ntimers)
+		return 0;
+
+	if(!(timer = gt_timer_expire(&(k_ctx->kthread_timers), gt_timer_now())))
+		return 0;
+
+	TAILQ_INIT(&u_list);
+	for(; timer; timer = next)
+	{
+		next = timer->next;
+		u_obj = (uthread_struct_t *)((char *)timer - offsetof(uthread_struct_t, uthread_timer));
+		u_obj->uthread_state = UTHREAD_RUNNABLE;
+		uthread_credit_boost(u_obj);
+		TAILQ_INSERT_TAIL(&u_list, u_obj, uthread_runq);
+		nwoken++;
+	}
+
+	add_list_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), &u_list);
+	return nwoken;
+}
+
+extern int uthread_idle_poll(void)
+{
+	kthread_context_t *k_ctx;
+	int nwoken;
+
+	k_ctx = kthread_preempt_disable_current();
+	nwoken = (k_ctx->scheduler == GT_SCHED_CREDIT) ? ksched_credit_account() : 0;
+	nwoken += uthread_timers_run(k_ctx);
+	nwoken += kthread_inbox_splice(&(k_ctx->krunqueue));
+	nwoken += gt_io_poll(k_ctx, NULL);
+	nwoken += gt_uring_poll(k_ctx);
+	if(kthread_preempt_enable(k_ctx))
+		nwoken++;
+
+	/* Woken up from elsewhere (other kthreads, gt_blocking helpers) */
+	if(k_ctx->krunqueue.active_runq->uthread_tot)
+		nwoken++;
+
+	return nwoken;
+}
+
+extern void uthread_sleep_until(unsigned long deadline)
+{
+	kthread_context_t *k_ctx = kthread_current();
+	uthread_struct_t *u_obj;
+	struct timespec ts;
+
+	if(!k_ctx || !k_ctx->krunqueue.cur_uthread)
+	{
+		ts.tv_sec = deadline / 1000000000UL;
+		ts.tv_nsec = deadline % 1000000000UL;
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		return;
+	}
+
+	k_ctx = kthread_preempt_disable_current();
+	if(deadline <= gt_timer_now())
+	{
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
+		return;
+	}
+
+	/* Only this kthread turns its wheel, and not before we are switched out */
+	u_obj = k_ctx->krunqueue.cur_uthread;
+	u_obj->uthread_timer.expires = deadline;
+	gt_timer_add(&(k_ctx->kthread_timers), &(u_obj->uthread_timer));
+	uthread_park(NULL);
+	return;
+}
+
+extern void uthread_sleep_ns(unsigned long nsec)
+{
+	uthread_sleep_until(gt_timer_now() + nsec);
+}
+
+/**********************************************************************/
+/* join/detach */
+
+/* Caller holds the bucket lock */
+static uthread_struct_t *uthread_tid_lookup(uthread_tid_bucket_t *bucket, uthread_t u_tid)
+{
+	uthread_struct_t *u_obj;
+
+	for(u_obj = bucket->head; u_obj; u_obj = u_obj->uthread_tid_next)
+		if(u_obj->uthread_tid == u_tid)
+			break;
+
+	return u_obj;
+}
+
+/* Caller holds the bucket lock */
+static void uthread_tid_remove(uthread_tid_bucket_t *bucket, uthread_struct_t *u_obj)
+{
+	uthread_struct_t **u_link;
+
+	for(u_link = &(bucket->head); *u_link != u_obj; u_link = &((*u_link)->uthread_tid_next))
+		;
+	*u_link = u_obj->uthread_tid_next;
+	return;
+}
+
+extern int uthread_join(uthread_t u_tid, void **u_status)
+{
+	kthread_context_t *k_ctx;
+	uthread_tid_bucket_t *bucket = UTHREAD_TID_BUCKET(u_tid);
+	uthread_struct_t *u_obj, *u_self;
+	int do_free;
+
+	if(!(k_ctx = kthread_current()))
+		return -1;
+
+	k_ctx = kthread_preempt_disable_current();
+	u_self = k_ctx->krunqueue.cur_uthread;
+	gt_spin_lock(&(bucket->lock));
+
+	if(!(u_obj = uthread_tid_lookup(bucket, u_tid)) || (u_obj == u_self) ||
+		(u_obj->uthread_flags & (UTHREAD_DETACHED | UTHREAD_JOINED)) || u_obj->uthread_joiner ||
+		(!u_self && !(u_obj->uthread_state & UTHREAD_DONE)))
+	{
+		gt_spin_unlock(&(bucket->lock));
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
+		return -1;
+	}
+
+	if(!(u_obj->uthread_state & UTHREAD_DONE))
+	{
+		/* Woken up by u_obj in uthread_context_func */
+		u_obj->uthread_joiner = u_self;
+		uthread_park(&(bucket->lock));
+
+		k_ctx = kthread_preempt_disable_current();
+		gt_spin_lock(&(bucket->lock));
+	}
+
+	if(u_status)
+		*u_status = u_obj->exit_status;
+
+	u_obj->uthread_flags |= UTHREAD_JOINED;
+	if((do_free = (u_obj->uthread_flags & UTHREAD_REAPED)))
+		uthread_tid_remove(bucket, u_obj);
+	gt_spin_unlock(&(bucket->lock));
+
+	if(do_free)
+		uthread_cache_free(&(k_ctx->kthread_uthreads), u_obj);
+
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+	return 0;
+}
+
+extern int uthread_detach(uthread_t u_tid)
+{
+	kthread_context_t *k_ctx;
+	uthread_tid_bucket_t *bucket = UTHREAD_TID_BUCKET(u_tid);
+	uthread_struct_t *u_obj;
+	int ret = -1, do_free = 0;
+
+	if(!(k_ctx = kthread_current()))
+		return -1;
+
+	k_ctx = kthread_preempt_disable_current();
+	gt_spin_lock(&(bucket->lock));
+
+	if((u_obj = uthread_tid_lookup(bucket, u_tid)) &&
+		!(u_obj->uthread_flags & (UTHREAD_DETACHED | UTHREAD_JOINED)) && !u_obj->uthread_joiner)
+	{
+		u_obj->uthread_flags |= UTHREAD_DETACHED;
+		if((do_free = (u_obj->uthread_flags & UTHREAD_REAPED)))
+			uthread_tid_remove(bucket, u_obj);
+		ret = 0;
+	}
+	gt_spin_unlock(&(bucket->lock));
+
+	if(do_free)
+		uthread_cache_free(&(k_ctx->kthread_uthreads), u_obj);
+
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+	return ret;
+}
+
+extern int uthread_set_credits(uthread_t u_tid, int weight, unsigned int cap)
+{
+	kthread_context_t *k_ctx;
+	uthread_tid_bucket_t *bucket = UTHREAD_TID_BUCKET(u_tid);
+	uthread_struct_t *u_obj;
+	int ret = -1;
+
+	if((weight < 1) || !(k_ctx = kthread_current()))
+		return -1;
+
+	k_ctx = kthread_preempt_disable_current();
+	gt_spin_lock(&(bucket->lock));
+
+	/* Read at the next accounting */
+	if((u_obj = uthread_tid_lookup(bucket, u_tid)) && !(u_obj->uthread_state & UTHREAD_DONE))
+	{
+		u_obj->uthread_weight = weight;
+		u_obj->uthread_cap = cap;
+		ret = 0;
+	}
+	gt_spin_unlock(&(bucket->lock));
+
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+	return ret;
+}
+
+extern int uthread_group_set_credits(uthread_group_t u_gid, int weight)
+{
+	ksched_shared_info_t *ksched_info = &ksched_shared_info;
+	kthread_context_t *k_ctx;
+
+	if((u_gid >= MAX_UTHREAD_GROUPS) || (weight < 0) || !(k_ctx = kthread_current()))
+		return -1;
+
+	/* Read at the next accounting */
+	k_ctx = kthread_preempt_disable_current();
+	gt_spin_lock(&(ksched_info->credit_lock));
+	ksched_info->credit_group_weight[u_gid] = weight;
+	gt_spin_unlock(&(ksched_info->credit_lock));
+
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+	return 0;
+}
+
+/**********************************************************************/
+/* uthread struct cache (callers have preemption disabled) */
+
+/* Returns a zeroed uthread struct. Steady state does not malloc. */
+static uthread_struct_t *uthread_cache_alloc(uthread_cache_t *cache)
+{
+	uthread_struct_t *u_obj, *u_next;
+
+	if(!cache->free_uthreads && cache->remote_free)
+	{
+		/* Take over everything other kthreads returned */
+		u_obj = __sync_lock_test_and_set(&(cache->remote_free), NULL);
+		for(; u_obj; u_obj = u_next)
+		{
+			u_next = u_obj->uthread_cache_next;
+			u_obj->uthread_cache_next = cache->free_uthreads;
+			cache->free_uthreads = u_obj;
+			cache->nfree++;
+		}
+	}
+
+	if((u_obj = cache->free_uthreads))
+	{
+		cache->free_uthreads = u_obj->uthread_cache_next;
+		cache->nfree--;
+		memset(u_obj, 0, sizeof(uthread_struct_t));
+	}
+	else if(!(u_obj = (uthread_struct_t *)MALLOCZ_SAFE(sizeof(uthread_struct_t))))
+		return NULL;
+
+	u_obj->uthread_home = cache;
+	return u_obj;
+}
+
+static void uthread_cache_free(uthread_cache_t *cache, uthread_struct_t *u_obj)
+{
+	uthread_cache_t *home = u_obj->uthread_home;
+	uthread_struct_t *head;
+
+	if(home != cache)
+	{
+		/* Remote free : lock-free push onto the home cache */
+		do
+		{
+			head = home->remote_free;
+			u_obj->uthread_cache_next = head;
+		} while(!__sync_bool_compare_and_swap(&(home->remote_free), head, u_obj));
+		return;
+	}
+
+	if(cache->nfree >= UTHREAD_CACHE_MAX)
+	{
+		FREE_SAFE(u_obj);
+		return;
+	}
+
+	u_obj->uthread_cache_next = cache->free_uthreads;
+	cache->free_uthreads = u_obj;
+	cache->nfree++;
+	return;
 }
 
 /**********************************************************************/
@@ -334,38 +815,46 @@ extern kthread_runqueue_t *ksched_find_target(uthread_struct_t *);
 
 extern int uthread_create(uthread_t *u_tid, int (*u_func)(void *), void *u_arg, uthread_group_t u_gid, int credits)
 {
+	kthread_context_t *k_ctx;
 	kthread_runqueue_t *kthread_runq;
 	uthread_struct_t *u_new;
 
 	/* Signals used for cpu_thread scheduling */
 	// kthread_block_signal(SIGVTALRM);
-	// kthread_block_signal(SIGUSR1);
 
-	/* create a new uthread structure and fill it */
-	if(!(u_new = (uthread_struct_t *)MALLOCZ_SAFE(sizeof(uthread_struct_t))))
+	/* Runq buckets and masks are per group */
+	if(u_gid >= MAX_UTHREAD_GROUPS)
+		return -1;
+
+	/* create a new uthread structure and stack (from this kthread's caches) */
+	k_ctx = kthread_preempt_disable_current();
+
+	if(!(u_new = uthread_cache_alloc(&(k_ctx->kthread_uthreads))))
 	{
 		fprintf(stderr, "uthread mem alloc failure !!");
 		exit(0);
 	}
 
-	u_new->uthread_state = UTHREAD_INIT;
-    u_new->init_time = clock();
-	u_new->used_time = 0;
-    u_new->uthread_original_credits = credits;
-	u_new->uthread_credits = credits; // Used only by credit scheduler
-	u_new->uthread_gid = u_gid;
-	u_new->uthread_func = u_func;
-	u_new->uthread_arg = u_arg;
-
-	/* Allocate new stack for uthread */
-	u_new->uthread_stack.ss_flags = 0; /* Stack enabled for signal handling */
-	if(!(u_new->uthread_stack.ss_sp = (void *)MALLOC_SAFE(UTHREAD_DEFAULT_SSIZE)))
+	if(!(u_new->uthread_stack = gt_stack_alloc(&(k_ctx->kthread_stacks))))
 	{
+		uthread_cache_free(&(k_ctx->kthread_uthreads), u_new);
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
 		fprintf(stderr, "uthread stack mem alloc failure !!");
 		return -1;
 	}
 
-	u_new->uthread_stack.ss_size = UTHREAD_DEFAULT_SSIZE;
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
+
+	u_new->uthread_state = UTHREAD_INIT;
+    u_new->init_time = gt_timer_now();
+	u_new->used_time = 0;
+	u_new->uthread_weight = (credits < 1) ? UTHREAD_DEFAULT_CREDITS : credits; // Used only by credit scheduler
+	u_new->uthread_credits = 0; // Earned at the first accounting
+	u_new->uthread_gid = u_gid;
+	u_new->uthread_func = u_func;
+	u_new->uthread_arg = u_arg;
 
 	{
 		ksched_shared_info_t *ksched_info = &ksched_shared_info;
@@ -379,29 +868,71 @@ extern int uthread_create(uthread_t *u_tid, int (*u_func)(void *), void *u_arg,
 			u_new->uthread_priority = UTHREAD_CREDIT_UNDER;
 		}
 
+		/* The scheduler takes ksched_lock too : not with preemption on */
+		k_ctx = kthread_preempt_disable_current();
+		if (ksched_info->scheduler == GT_SCHED_CREDIT) {
+			gt_spin_lock(&(ksched_info->credit_lock));
+			TAILQ_INSERT_TAIL(&(ksched_info->credit_uthreads), u_new, uthread_credit_link);
+			u_new->uthread_credit_flags |= UTHREAD_CREDIT_LISTED;
+			gt_spin_unlock(&(ksched_info->credit_lock));
+		}
 		gt_spin_lock(&ksched_info->ksched_lock);
 		u_new->uthread_tid = ksched_info->kthread_tot_uthreads++;
 		ksched_info->kthread_cur_uthreads++;
 		gt_spin_unlock(&ksched_info->ksched_lock);
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
+	}
+
+	/* Joinable from now on */
+	{
+		uthread_tid_bucket_t *bucket = UTHREAD_TID_BUCKET(u_new->uthread_tid);
+
+		k_ctx = kthread_preempt_disable_current();
+		gt_spin_lock(&(bucket->lock));
+		u_new->uthread_tid_next = bucket->head;
+		bucket->head = u_new;
+		gt_spin_unlock(&(bucket->lock));
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
 	}
 
 	#if DEBUG
 		fprintf(stderr, "uthread(%d) created successfully\n", u_new->uthread_tid);
 	#endif
 
+	*u_tid = u_new->uthread_tid;
+
+	if (ksched_shared_info.scheduler == GT_SCHED_STEAL)
+	{
+		/* Pushed locally; idle kthreads steal it if we are busy */
+		k_ctx = kthread_preempt_disable_current();
+		u_new->cpu_id = k_ctx->cpuid;
+		u_new->last_cpu_id = k_ctx->cpuid;
+		steal_add_uthread(&(k_ctx->krunqueue), u_new);
+		if(kthread_preempt_enable(k_ctx))
+			uthread_preempt_resched();
+		return 0;
+	}
+
 	/* XXX: ksched_find_target should be a function pointer */
+	k_ctx = kthread_preempt_disable_current();
 	kthread_runq = ksched_find_target(u_new);
 
-	*u_tid = u_new->uthread_tid;
-	/* Queue the uthread for target-cpu. Let target-cpu take care of initialization. */
-	add_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), u_new);
+	/* Queue the uthread for target-cpu. Let target-cpu take care of initialization.
+	 * Another kthread's runq : through its inbox, its runqlock stays local. */
+	if(kthread_runq != &(k_ctx->krunqueue))
+		kthread_inbox_push(kthread_runq, u_new);
+	else
+		add_to_runqueue(kthread_runq->active_runq, &(kthread_runq->kthread_runqlock), u_new);
+	if(kthread_preempt_enable(k_ctx))
+		uthread_preempt_resched();
 
 
 	/* WARNING : DONOT USE u_new WITHOUT A LOCK, ONCE IT IS ENQUEUED. */
 
 	/* Resume with the old thread (with all signals enabled) */
 	// kthread_unblock_signal(SIGVTALRM);
-	// kthread_unblock_signal(SIGUSR1);
 
 	return 0;
 }
@@ -3,7 +3,7 @@
 
 #include <time.h>
 
-/* User-level thread implementation (using alternate signal stacks) */
+/* User-level thread implementation (each uthread runs on its own stack) */
 
 typedef unsigned int uthread_t;
 typedef unsigned int uthread_group_t;
@@ -14,21 +14,53 @@ typedef unsigned int uthread_group_t;
 #define UTHREAD_RUNNING 0x04
 #define UTHREAD_CANCELLED 0x08
 #define UTHREAD_DONE 0x10
+#define UTHREAD_WAITING 0x20 /* parked (uthread_park), on some wait list */
 
-/* Credit scheduler states */
-#define UTHREAD_CREDIT_UNDER 0x01
-#define UTHREAD_CREDIT_OVER 0x02
+/* uthread flags (uthread_join/uthread_detach, under the tid table lock) */
+#define UTHREAD_DETACHED 0x01 /* nobody will join : reap it when DONE */
+#define UTHREAD_JOINED 0x02 /* exit status collected */
+#define UTHREAD_REAPED 0x04 /* stack released, struct kept for the joiner */
 
-#define UTHREAD_DEFAULT_CREDITS 25
+/* Credit scheduler states (runq priority levels : the lowest runs first) */
+#define UTHREAD_CREDIT_BOOST 0x00 /* woken up with credits left : ahead of UNDER till charged */
+#define UTHREAD_CREDIT_UNDER 0x01 /* credits left */
+#define UTHREAD_CREDIT_OVER 0x02 /* used more than its share */
+
+#define UTHREAD_DEFAULT_CREDITS 25 /* default weight */
+
+/* uthread credit flags (ksched_shared_info.credit_lock) */
+#define UTHREAD_CREDIT_LISTED 0x01 /* on ksched_shared_info.credit_uthreads */
+#define UTHREAD_CREDIT_PARKED 0x02 /* capped and OVER : off the runqs till the next accounting */
+#define UTHREAD_CREDIT_COUNTED 0x04 /* in the weights of the accounting under way */
+
+#define UTHREAD_DEFAULT_SSIZE (32 * 1024)
+#define UTHREAD_CACHE_MAX 1024 /* free uthread structs kept per kthread */
+
+struct uthread_struct;
+struct __kthread_context;
+
+/* Per-kthread cache of free uthread structs. Same scheme as the stack cache
+ * (gt_stack.h) : owner-only free list, remote kthreads push on remote_free. */
+typedef struct __uthread_cache
+{
+	struct uthread_struct *free_uthreads;
+	unsigned int nfree;
+	unsigned int reserved;
+	struct uthread_struct * volatile remote_free;
+} uthread_cache_t;
 
 /* uthread struct : has all the uthread context info */
 typedef struct uthread_struct
 {
 	
-	int uthread_state; /* UTHREAD_INIT, UTHREAD_RUNNABLE, UTHREAD_RUNNING, UTHREAD_CANCELLED, UTHREAD_DONE */
+	int uthread_state; /* UTHREAD_INIT, UTHREAD_RUNNABLE, UTHREAD_RUNNING, UTHREAD_CANCELLED, UTHREAD_DONE, UTHREAD_WAITING */
+	int uthread_flags; /* UTHREAD_DETACHED, UTHREAD_JOINED, UTHREAD_REAPED */
 	int uthread_priority; /* uthread running priority */
-    int uthread_original_credits;
-	double uthread_credits; /* Current credit count (used only in credit scheduler!) */
+    int uthread_weight; /* credit scheduler : share of the cpu against the other uthreads */
+	volatile long uthread_credits; /* credit scheduler : ns of cpu left this period (< 0 : OVER) */
+	unsigned int uthread_cap; /* credit scheduler : max % of one kthread, 0 : no cap */
+	unsigned int uthread_credit_flags; /* UTHREAD_CREDIT_LISTED, UTHREAD_CREDIT_PARKED, UTHREAD_CREDIT_COUNTED */
+	volatile int uthread_credit_active; /* charged since the last accounting */
 	int cpu_id; /* cpu it is currently executing on */
 	int last_cpu_id; /* last cpu it was executing on */
 	
@@ -37,20 +69,33 @@ typedef struct uthread_struct
 	int (*uthread_func)(void*);
 	void *uthread_arg;
 
-    clock_t init_time;
-    clock_t runnable_time;
-    clock_t running_time;
-    clock_t done_time;
-	double used_time;
+    /* ns : events on gt_timer_now, running_time on the cpu clock of the
+     * kthread it runs on (gt_timer_cputime) */
+    unsigned long init_time;
+    unsigned long runnable_time;
+    unsigned long running_time; /* at dispatch */
+    unsigned long done_time;
+	unsigned long used_time; /* on cpu */
 
 	void *exit_status; /* exit status */
 	int reserved1;
 	int reserved2;
 	int reserved3;
 	
-	sigjmp_buf uthread_env; /* 156 bytes : save user-level thread context*/
-	stack_t uthread_stack; /* 12 bytes : user-level thread stack */
+	gt_context_t uthread_ctx; /* 72 bytes : save user-level thread context (no signal mask) */
+	gt_stack_t *uthread_stack; /* user-level thread stack (mmap'd, guard page below) */
 	TAILQ_ENTRY(uthread_struct) uthread_runq;
+
+	uthread_cache_t *uthread_home; /* cache of the kthread that allocated it */
+	struct uthread_struct *uthread_cache_next; /* cache free list link */
+
+	struct __kthread_context *uthread_kctx; /* kthread it runs (last ran) on */
+	volatile int uthread_oncpu; /* requeued, but its context is not saved yet */
+	struct uthread_struct *uthread_joiner; /* uthread parked in uthread_join */
+	struct uthread_struct *uthread_tid_next; /* tid table chain */
+	struct uthread_struct *uthread_inbox_next; /* kthread inbox (gt_pq.h) */
+	gt_timer_t uthread_timer; /* uthread_sleep (kthread_timers of uthread_kctx) */
+	TAILQ_ENTRY(uthread_struct) uthread_credit_link; /* ksched_shared_info.credit_uthreads */
 } uthread_struct_t;
 
 typedef struct matrix
@@ -75,11 +120,80 @@ typedef struct __uthread_arg
 	unsigned int credits; // Original num credits
 	struct timeval created; // Creation time (real)
 	struct timeval runtime; // Run time (real)
-	double used_time;
 	unsigned int size; // Matrix size
 } uthread_arg_t;
 
+/* uthread_schedule reasons */
+#define UTHREAD_SCHED_EXIT 0 /* current uthread is DONE */
+#define UTHREAD_SCHED_TIMER 1 /* timeslice expired (or kthread scheduling loop) */
+#define UTHREAD_SCHED_YIELD 2 /* current uthread gives up the cpu (uthread_yield) */
+#define UTHREAD_SCHED_BLOCK 3 /* current uthread is WAITING (uthread_park) */
+
 struct __kthread_runqueue;
 extern void uthread_schedule(uthread_struct_t * (*kthread_best_sched_uthread)(struct __kthread_runqueue *),
-                             int from_timer);
+                             int sched_reason);
+/* uthread_schedule with the find-best function of the scheduler in use */
+extern void uthread_reschedule(int sched_reason);
+/* Reschedule for a tick recorded while preemption was off (kthread_preempt_enable) */
+extern void uthread_preempt_resched(void);
+/* First thing done in the context switched to (see uthread_schedule) */
+extern void uthread_switch_finish(void);
+
+/* Blocking support for wait objects. A waiter queues itself on a wait list
+ * under the list's spinlock, with preemption disabled (kthread_preempt_disable),
+ * and calls uthread_park(lock). The lock is released once the waiter is
+ * switched out, so a waker (holding the same lock) never sees it half-parked.
+ * uthread_park returns after uthread_wakeup, with preemption enabled. */
+extern void uthread_park(gt_spinlock_t *lock);
+/* Caller holds the wait list lock. Requeued on the kthread it parked on
+ * (GT_SCHED_STEAL : pushed on the waker's deque). */
+extern void uthread_wakeup(uthread_struct_t *u_obj);
+/* GT_SCHED_CREDIT : level of a uthread going back on a runq after it
+ * waited (BOOST with credits left). No-op with other schedulers. */
+extern void uthread_credit_boost(uthread_struct_t *u_obj);
+
+/**********************************************************************/
+/* uthread api(s) */
+extern int uthread_create(uthread_t *u_tid, int (*u_func)(void *), void *u_arg, uthread_group_t u_gid, int credits);
+
+/* GT_SCHED_CREDIT : sets the weight (credits at uthread_create) and the cap
+ * (max % of one kthread, 0 : none) of u_tid. Credits are handed out every
+ * accounting period in proportion to the weights; a capped uthread that
+ * used up its share waits for the next period even if a kthread is idle.
+ * -1 if u_tid is unknown or done, or weight < 1. */
+extern int uthread_set_credits(uthread_t u_tid, int weight, unsigned int cap);
+
+/* GT_SCHED_CREDIT : gives group u_gid a weight of its own : its uthreads
+ * then share the cpu of one uthread of that weight (eg. one group per
+ * tenant). 0 (the default) : each of its uthreads counts on its own.
+ * -1 if u_gid is out of range or weight < 0. */
+extern int uthread_group_set_credits(uthread_group_t u_gid, int weight);
+
+/* Gives up the cpu : requeued at the tail of its level in the active runq
+ * (PRIORITY), charged for the credits it used (CREDIT) or pushed at the
+ * back of its kthread's deque (STEAL), then switches
+ * to the next best uthread. No-op outside a uthread. */
+extern void uthread_yield(void);
+
+/* uthreads are joinable till uthread_join or uthread_detach. A DONE uthread
+ * keeps its struct (not its stack) until then. Both return -1 if u_tid is
+ * unknown, detached or already joined (or being joined).
+ * uthread_join waits for u_tid to finish and returns its exit status
+ * (the int returned by its function) in *u_status. Only a uthread can
+ * wait; from main, u_tid must be DONE already. */
+extern int uthread_join(uthread_t u_tid, void **u_status);
+extern int uthread_detach(uthread_t u_tid);
+
+/* Parks the calling uthread till CLOCK_MONOTONIC reaches 'deadline' (ns)
+ * or for 'nsec' ns. Sleepers sit in their kthread's timer wheel (in no
+ * runq) and are requeued, in batches, by the scheduler or the idle loop.
+ * main (not a uthread) blocks in clock_nanosleep. */
+extern void uthread_sleep_until(unsigned long deadline);
+extern void uthread_sleep_ns(unsigned long nsec);
+
+/* Idle loop : requeues due sleepers, ready io waiters (gt_io.h) and
+ * completed file I/O submitters (gt_uring.h).
+ * Non-zero if the kthread should schedule (runnable uthreads or a tick
+ * is pending). */
+extern int uthread_idle_poll(void);
 #endif